@@ -133,20 +133,6 @@ as112_zone *search_zones(ldns_rdf *qname, int *count)
 	return NULL;
 }
 
-/* rejects packets that arrive with OPCODE != QUERY, or QDCOUNT != 1 */
-void query_only(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass)
-{
-	ldns_pkt *req = srq->request;
-
-	if (ldns_pkt_get_opcode(req) != LDNS_PACKET_QUERY) {
-		srq->response = evldns_response(req, LDNS_RCODE_NOTIMPL);
-	}
-
-	if (ldns_pkt_qdcount(req) != 1) {
-		srq->response = evldns_response(req, LDNS_RCODE_FORMERR);
-	}
-}
-
 void as112_callback(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass)
 {
 	/* copy the question and determine qtype and qname */
@@ -199,7 +185,6 @@ int main(int argc, char *argv[])
 	p = evldns_add_server(base);
 	evldns_add_server_port(p, bind_to_udp4_port(5053));
 	evldns_add_server_port(p, bind_to_tcp4_port(5053, 10));
-	evldns_add_callback(p, NULL, LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, query_only, NULL);
 	evldns_add_callback(p, "*.in-addr.arpa.", LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, as112_callback, NULL);
 	event_base_dispatch(base);
 
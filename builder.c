@@ -0,0 +1,298 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009-2014, Nominet UK.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Nominet UK nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY Nominet UK ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Nominet UK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * A response builder writes a wire format response straight into a
+ * buffer: the header and copied question, then RRs section by section,
+ * and finally the OPT record, with the section counts updated in the
+ * header as each record is added.
+ *
+ * Owner names are compressed against a small table of the offsets of
+ * names (and their suffixes) already written.  Records must be added
+ * in section order.  If one doesn't fit the response is truncated at
+ * the end of the previous record, setting TC under the same rules as
+ * evldns_set_udp_max() uses.  Room is kept for the
+ * OPT record if the request had one, so that it's never truncated.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <evldns.h>
+
+#define BUILDER_MAXPTR		0x3fff
+#define BUILDER_OPTSIZE		11
+
+/* remembers where each label of a name written at 'off' starts */
+static void
+builder_add_names(struct evldns_builder *b, size_t off)
+{
+	while (b->buf[off] && b->nnames < EVLDNS_BUILDER_NAMES) {
+		if ((b->buf[off] & 0xc0) == 0xc0 || off > BUILDER_MAXPTR) {
+			break;
+		}
+		b->names[b->nnames++] = (uint16_t)off;
+		off += b->buf[off] + 1;
+	}
+}
+
+static int
+builder_label_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	while (len--) {
+		if (tolower(*a++) != tolower(*b++)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * does the (possibly compressed) name at 'off' in the buffer equal the
+ * uncompressed name 'name', ignoring case?
+ */
+static int
+builder_name_match(const struct evldns_builder *b, size_t off, const uint8_t *name)
+{
+	int hops = 0;
+
+	for (;;) {
+		uint8_t c = b->buf[off];
+
+		if ((c & 0xc0) == 0xc0) {
+			if (++hops > 32) {
+				return 0;
+			}
+			off = ((c & 0x3f) << 8) | b->buf[off + 1];
+			continue;
+		}
+
+		if (c != *name) {
+			return 0;
+		}
+		if (c == 0) {
+			return 1;
+		}
+		if (!builder_label_equal(b->buf + off + 1, name + 1, c)) {
+			return 0;
+		}
+		off += c + 1;
+		name += c + 1;
+	}
+}
+
+/*
+ * writes 'name' compressed against the names already in the buffer,
+ * returning -1 if it doesn't fit
+ */
+static int
+builder_put_name(struct evldns_builder *b, const uint8_t *name)
+{
+	const uint8_t *p = name;
+	size_t start = b->len;
+	unsigned int i;
+
+	/* find the longest suffix that's already been written */
+	for (; *p; p += *p + 1) {
+		for (i = 0; i < b->nnames; ++i) {
+			if (builder_name_match(b, b->names[i], p)) {
+				size_t n = p - name;
+				if (b->len + n + 2 > b->max) {
+					return -1;
+				}
+				memcpy(b->buf + b->len, name, n);
+				ldns_write_uint16(b->buf + b->len + n, 0xc000 | b->names[i]);
+				b->len += n + 2;
+				builder_add_names(b, start);
+				return 0;
+			}
+		}
+	}
+
+	/* no match - write the whole name */
+	if (b->len + (p - name) + 1 > b->max) {
+		return -1;
+	}
+	memcpy(b->buf + b->len, name, p - name + 1);
+	b->len += p - name + 1;
+	builder_add_names(b, start);
+
+	return 0;
+}
+
+/*
+ * abandons the record started at 'mark', truncating the response.  TC
+ * is only set if an answer was lost, or the authority records of a
+ * response without answers - dropping additional records (or the
+ * authority records that go with an answer) leaves a usable response.
+ */
+static int
+builder_truncate(struct evldns_builder *b, size_t mark)
+{
+	b->len = mark;
+	if (b->section == LDNS_SECTION_ANSWER ||
+		(b->section == LDNS_SECTION_AUTHORITY && ldns_read_uint16(b->buf + 6) == 0))
+	{
+		b->buf[2] |= LDNS_TC_MASK;
+	}
+	b->truncated = 1;
+
+	return -1;
+}
+
+/*
+ * starts a response to 'req' in 'buf', with the header set up as
+ * evldns_response() would and the question copied from the request
+ */
+int
+evldns_builder_init(struct evldns_builder *b, uint8_t *buf, size_t max, const evldns_server_request *req, ldns_pkt_rcode rcode)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+	const uint8_t *query = req->wire_request;
+	size_t qlen = (qi->qdcount == 1) ? qi->qname_len + 4 : 0;
+
+	memset(b, 0, sizeof(*b));
+	b->buf = buf;
+	b->section = LDNS_SECTION_ANSWER;
+	b->edns = qi->edns;
+	b->edns_do = qi->edns_do;
+	b->reserve = qi->edns ? BUILDER_OPTSIZE : 0;
+	b->udp_max = req->udp_max ? req->udp_max : EVLDNS_UDP_MAX_DEFAULT;
+
+	if (LDNS_HEADER_SIZE + qlen + b->reserve > max) {
+		return -1;
+	}
+	b->max = max - b->reserve;
+	memset(buf, 0, LDNS_HEADER_SIZE);
+
+	ldns_write_uint16(buf, qi->id);						/* copy ID field */
+	buf[2] = LDNS_QR_MASK | (query[2] & LDNS_OPCODE_MASK);	/* copy opcode */
+	if (LDNS_OPCODE_WIRE(query) == LDNS_PACKET_QUERY) {
+		buf[2] |= query[2] & LDNS_RD_MASK;				/* copy RD bit */
+		buf[3] |= query[3] & LDNS_CD_MASK;				/* copy CD bit */
+	}
+	buf[3] |= rcode & LDNS_RCODE_MASK;
+	b->len = LDNS_HEADER_SIZE;
+
+	if (qlen) {
+		ldns_write_uint16(buf + 4, 1);
+		memcpy(buf + LDNS_HEADER_SIZE, query + qi->qname_offset, qlen);
+		builder_add_names(b, LDNS_HEADER_SIZE);
+		b->len += qlen;
+	}
+
+	return 0;
+}
+
+/*
+ * appends an RR to 'section', which may not come before the section of
+ * the previous RR.  A NULL 'owner' means the QNAME.
+ */
+int
+evldns_builder_rr(struct evldns_builder *b, ldns_pkt_section section, const uint8_t *owner, ldns_rr_type rr_type, ldns_rr_class rr_class, uint32_t ttl, const uint8_t *rdata, size_t rdlen)
+{
+	size_t mark = b->len;
+	uint8_t *p;
+
+	if (b->truncated || section < b->section || section > LDNS_SECTION_ADDITIONAL) {
+		return -1;
+	}
+	b->section = section;
+
+	if (owner) {
+		if (builder_put_name(b, owner) < 0) {
+			return builder_truncate(b, mark);
+		}
+	} else {
+		if (b->len + 2 > b->max || (b->buf[4] == 0 && b->buf[5] == 0)) {
+			return builder_truncate(b, mark);
+		}
+		ldns_write_uint16(b->buf + b->len, 0xc000 | LDNS_HEADER_SIZE);
+		b->len += 2;
+	}
+
+	if (rdlen > 0xffff || b->len + 10 + rdlen > b->max) {
+		return builder_truncate(b, mark);
+	}
+	p = b->buf + b->len;
+	ldns_write_uint16(p, rr_type);
+	ldns_write_uint16(p + 2, rr_class);
+	ldns_write_uint32(p + 4, ttl);
+	ldns_write_uint16(p + 8, rdlen);
+	if (rdlen) {
+		memcpy(p + 10, rdata, rdlen);
+	}
+	b->len += 10 + rdlen;
+
+	/* the counts follow QDCOUNT in section order */
+	p = b->buf + 4 + 2 * section;
+	ldns_write_uint16(p, ldns_read_uint16(p) + 1);
+
+	return 0;
+}
+
+/*
+ * appends an OPT record advertising 'udp_size' to the additional section
+ */
+int
+evldns_builder_opt(struct evldns_builder *b, uint16_t udp_size, int do_bit)
+{
+	b->opt = 1;
+	b->max += b->reserve;
+	b->reserve = 0;
+
+	/* the TTL field holds the extended RCODE, version and flags */
+	return evldns_builder_rr(b, LDNS_SECTION_ADDITIONAL, (const uint8_t *)"",
+		LDNS_RR_TYPE_OPT, udp_size, do_bit ? 0x8000 : 0, NULL, 0);
+}
+
+/*
+ * finishes the response, adding an OPT record as evldns_response()
+ * would if the request had one and none has been added yet.  Returns
+ * the length of the response.
+ */
+int
+evldns_builder_finish(struct evldns_builder *b)
+{
+	if (b->edns && !b->opt) {
+		int truncated = b->truncated;
+
+		/* the OPT record still goes in a truncated response */
+		b->truncated = 0;
+		(void)evldns_builder_opt(b, b->udp_max, b->edns_do);
+		b->truncated |= truncated;
+	}
+
+	return (int)b->len;
+}
@@ -30,6 +30,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <evldns.h>
 
 void nxdomain(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass)
@@ -38,25 +39,11 @@ void nxdomain(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns
 	srq->response = evldns_response(req, LDNS_RCODE_NXDOMAIN);
 }
 
-/* rejects packets that arrive with OPCODE != QUERY, or QDCOUNT != 1 */
-void query_only(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass)
-{
-	ldns_pkt *req = srq->request;
-
-	if (ldns_pkt_get_opcode(req) != LDNS_PACKET_QUERY) {
-		srq->response = evldns_response(req, LDNS_RCODE_NOTIMPL);
-	}
-
-	if (ldns_pkt_qdcount(req) != 1) {
-		srq->response = evldns_response(req, LDNS_RCODE_FORMERR);
-	}
-}
-
 int main(int argc, char *argv[])
 {
 	struct event_base			*base;
 	struct evldns_server		*p;
-	evldns_callback				 myip, txt;
+	evldns_wire_callback		 myip, txt;
 
 	base = event_base_new();
 	evldns_init();
@@ -73,15 +60,24 @@ int main(int argc, char *argv[])
 	evldns_load_plugin(p, ".libs/mod_txtrec.so");
 
 	/* get plugin defined functions */
-	myip = evldns_get_function("myip");
-	txt = evldns_get_function("txt");
+	myip = evldns_get_wire_function("myip");
+	txt = evldns_get_wire_function("txt");
 
-	/* register a list of callbacks */
-	evldns_add_callback(p, NULL, LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, query_only, NULL);
-	evldns_add_callback(p, "client.bind", LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, myip, NULL);
-	evldns_add_callback(p, "version.bind", LDNS_RR_CLASS_CH, LDNS_RR_TYPE_TXT, txt, "evldns-0.2");
-	evldns_add_callback(p, "author.bind", LDNS_RR_CLASS_CH, LDNS_RR_TYPE_TXT, txt, "Ray Bellis, R&D Nominet UK");
-	evldns_add_callback(p, "*", LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, nxdomain, NULL);
+	/*
+	 * register a list of callbacks, or with "-m" use the same list
+	 * compiled from chaos.match
+	 */
+	if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+		evldns_add_function("nxdomain", nxdomain);
+		if (evldns_load_plugin(p, ".libs/mod_chaosmatch.so") < 0) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		evldns_add_wire_callback(p, "client.bind", LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, myip, NULL);
+		evldns_add_wire_callback(p, "version.bind", LDNS_RR_CLASS_CH, LDNS_RR_TYPE_TXT, txt, "evldns-0.2");
+		evldns_add_wire_callback(p, "author.bind", LDNS_RR_CLASS_CH, LDNS_RR_TYPE_TXT, txt, "Ray Bellis, R&D Nominet UK");
+		evldns_add_callback(p, "*", LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, nxdomain, NULL);
+	}
 
 	/* and set it running */
 	event_base_dispatch(base);
@@ -0,0 +1,427 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009-2014, Nominet UK.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Nominet UK nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY Nominet UK ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Nominet UK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Wire format domain name helpers for the dispatcher and plugins:
+ * case folding, case-insensitive comparison, and folding combined
+ * with hashing.  Names are at most 255 bytes and label lengths are
+ * at most 63, so the length bytes can never be mistaken for upper
+ * case letters and whole names can be folded without parsing them.
+ *
+ * On x86 SSE2 and (where the CPU has it) AVX2 versions are chosen at
+ * run time.  The EVLDNS_DNAME_IMPL environment variable can be set to
+ * "scalar", "sse2" or "avx2" to override that, e.g. for benchmarking.
+ * All of the versions produce the same hash values.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define DNAME_X86 1
+#include <immintrin.h>
+#endif
+
+#include <evldns.h>
+
+#define DNAME_HASH_MUL	0x9e3779b97f4a7c15ULL
+
+static void dname_resolve(void);
+
+/*-------------------------------------------------------------------*/
+
+static inline uint8_t
+fold_byte(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* loads 8 bytes little-endian - compilers turn this into a single load */
+static inline uint64_t
+load_le64(const uint8_t *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+		(uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+		(uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t
+hash_word(uint64_t h, const uint8_t *p)
+{
+	h ^= load_le64(p);
+	h *= DNAME_HASH_MUL;
+	return h ^ (h >> 29);
+}
+
+static inline uint32_t
+hash_final(uint64_t h, size_t len)
+{
+	h ^= len;
+	h *= DNAME_HASH_MUL;
+	h ^= h >> 32;
+	return (uint32_t)h;
+}
+
+static void
+canonical_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		dst[i] = fold_byte(src[i]);
+	}
+}
+
+static int
+equal_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		if (fold_byte(a[i]) != fold_byte(b[i])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* hashes 8 bytes at a time, the last word padded with zeroes */
+static uint32_t
+canonical_hash_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint8_t tmp[8];
+	uint64_t h = 0;
+	size_t i;
+
+	canonical_scalar(dst, src, len);
+	for (i = 0; i + 8 <= len; i += 8) {
+		h = hash_word(h, dst + i);
+	}
+	if (i < len) {
+		memset(tmp, 0, sizeof(tmp));
+		memcpy(tmp, dst + i, len - i);
+		h = hash_word(h, tmp);
+	}
+
+	return hash_final(h, len);
+}
+
+/*-------------------------------------------------------------------*/
+
+#ifdef DNAME_X86
+
+/*
+ * shifting 'A' to -128 turns the range check into one signed compare
+ */
+static inline __m128i
+fold_sse2(__m128i v)
+{
+	__m128i r = _mm_sub_epi8(v, _mm_set1_epi8((char)('A' + 128)));
+	__m128i upper = _mm_cmplt_epi8(r, _mm_set1_epi8(-128 + 26));
+	return _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static void
+canonical_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint8_t tmp[16];
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), fold_sse2(v));
+	}
+	if (i < len) {
+		memcpy(tmp, src + i, len - i);
+		__m128i v = _mm_loadu_si128((const __m128i *)tmp);
+		_mm_storeu_si128((__m128i *)tmp, fold_sse2(v));
+		memcpy(dst + i, tmp, len - i);
+	}
+}
+
+static int
+equal_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	uint8_t ta[16], tb[16];
+	__m128i va, vb;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		va = fold_sse2(_mm_loadu_si128((const __m128i *)(a + i)));
+		vb = fold_sse2(_mm_loadu_si128((const __m128i *)(b + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+			return 0;
+		}
+	}
+	if (i < len) {
+		memset(ta, 0, sizeof(ta));
+		memset(tb, 0, sizeof(tb));
+		memcpy(ta, a + i, len - i);
+		memcpy(tb, b + i, len - i);
+		va = fold_sse2(_mm_loadu_si128((const __m128i *)ta));
+		vb = fold_sse2(_mm_loadu_si128((const __m128i *)tb));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint32_t
+canonical_hash_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint8_t tmp[16];
+	uint64_t h = 0;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), fold_sse2(v));
+		h = hash_word(h, dst + i);
+		h = hash_word(h, dst + i + 8);
+	}
+	if (i < len) {
+		memset(tmp, 0, sizeof(tmp));
+		memcpy(tmp, src + i, len - i);
+		__m128i v = _mm_loadu_si128((const __m128i *)tmp);
+		_mm_storeu_si128((__m128i *)tmp, fold_sse2(v));
+		memcpy(dst + i, tmp, len - i);
+		h = hash_word(h, tmp);
+		if (len - i > 8) {
+			h = hash_word(h, tmp + 8);
+		}
+	}
+
+	return hash_final(h, len);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i
+fold_avx2(__m256i v)
+{
+	__m256i r = _mm256_sub_epi8(v, _mm256_set1_epi8((char)('A' + 128)));
+	__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), r);
+	return _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+static AVX2 void
+canonical_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint8_t tmp[32];
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), fold_avx2(v));
+	}
+	if (i < len) {
+		memcpy(tmp, src + i, len - i);
+		__m256i v = _mm256_loadu_si256((const __m256i *)tmp);
+		_mm256_storeu_si256((__m256i *)tmp, fold_avx2(v));
+		memcpy(dst + i, tmp, len - i);
+	}
+}
+
+static AVX2 int
+equal_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	uint8_t ta[32], tb[32];
+	__m256i va, vb;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		va = fold_avx2(_mm256_loadu_si256((const __m256i *)(a + i)));
+		vb = fold_avx2(_mm256_loadu_si256((const __m256i *)(b + i)));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1) {
+			return 0;
+		}
+	}
+	if (i < len) {
+		memset(ta, 0, sizeof(ta));
+		memset(tb, 0, sizeof(tb));
+		memcpy(ta, a + i, len - i);
+		memcpy(tb, b + i, len - i);
+		va = fold_avx2(_mm256_loadu_si256((const __m256i *)ta));
+		vb = fold_avx2(_mm256_loadu_si256((const __m256i *)tb));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static AVX2 uint32_t
+canonical_hash_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint8_t tmp[32];
+	uint64_t h = 0;
+	size_t i, j;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), fold_avx2(v));
+		for (j = 0; j < 32; j += 8) {
+			h = hash_word(h, dst + i + j);
+		}
+	}
+	if (i < len) {
+		memset(tmp, 0, sizeof(tmp));
+		memcpy(tmp, src + i, len - i);
+		__m256i v = _mm256_loadu_si256((const __m256i *)tmp);
+		_mm256_storeu_si256((__m256i *)tmp, fold_avx2(v));
+		memcpy(dst + i, tmp, len - i);
+		for (j = 0; j < len - i; j += 8) {
+			h = hash_word(h, tmp + j);
+		}
+	}
+
+	return hash_final(h, len);
+}
+
+#endif /* DNAME_X86 */
+
+/*-------------------------------------------------------------------*/
+
+/*
+ * the chosen implementations - until the first call these point at
+ * functions that make the choice and then pass the call on
+ */
+static void canonical_first(uint8_t *dst, const uint8_t *src, size_t len);
+static int equal_first(const uint8_t *a, const uint8_t *b, size_t len);
+static uint32_t canonical_hash_first(uint8_t *dst, const uint8_t *src, size_t len);
+
+static void (*canonical_impl)(uint8_t *, const uint8_t *, size_t) = canonical_first;
+static int (*equal_impl)(const uint8_t *, const uint8_t *, size_t) = equal_first;
+static uint32_t (*canonical_hash_impl)(uint8_t *, const uint8_t *, size_t) = canonical_hash_first;
+static const char *impl_name = "scalar";
+
+static void
+dname_resolve(void)
+{
+	const char *want = getenv("EVLDNS_DNAME_IMPL");
+	void (*canonical)(uint8_t *, const uint8_t *, size_t) = canonical_scalar;
+	int (*equal)(const uint8_t *, const uint8_t *, size_t) = equal_scalar;
+	uint32_t (*canonical_hash)(uint8_t *, const uint8_t *, size_t) = canonical_hash_scalar;
+	const char *name = "scalar";
+
+#ifdef DNAME_X86
+	if (!want || strcmp(want, "scalar") != 0) {
+		canonical = canonical_sse2;
+		equal = equal_sse2;
+		canonical_hash = canonical_hash_sse2;
+		name = "sse2";
+
+		__builtin_cpu_init();
+		if ((!want || strcmp(want, "sse2") != 0) &&
+			__builtin_cpu_supports("avx2"))
+		{
+			canonical = canonical_avx2;
+			equal = equal_avx2;
+			canonical_hash = canonical_hash_avx2;
+			name = "avx2";
+		}
+	}
+#else
+	(void)want;
+#endif
+
+	/* racing threads would all store the same values */
+	impl_name = name;
+	canonical_hash_impl = canonical_hash;
+	equal_impl = equal;
+	canonical_impl = canonical;
+}
+
+static void
+canonical_first(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	dname_resolve();
+	canonical_impl(dst, src, len);
+}
+
+static int
+equal_first(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	dname_resolve();
+	return equal_impl(a, b, len);
+}
+
+static uint32_t
+canonical_hash_first(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	dname_resolve();
+	return canonical_hash_impl(dst, src, len);
+}
+
+/*-------------------------------------------------------------------*/
+
+/* copies 'len' bytes of a wire format name to 'dst' in lower case */
+void
+evldns_dname_canonical(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	canonical_impl(dst, src, len);
+}
+
+/* returns non-zero if the two wire format names are equal, ignoring case */
+int
+evldns_dname_equal(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+	return alen == blen && equal_impl(a, b, alen);
+}
+
+/*
+ * as evldns_dname_canonical(), also returning a hash of the lower
+ * cased name.  'dst' may be the same as 'src'.
+ */
+uint32_t
+evldns_dname_canonical_hash(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	return canonical_hash_impl(dst, src, len);
+}
+
+/* the name of the implementation in use, i.e. "scalar", "sse2" or "avx2" */
+const char *
+evldns_dname_impl(void)
+{
+	if (canonical_impl == canonical_first) {
+		dname_resolve();
+	}
+	return impl_name;
+}
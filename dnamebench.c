@@ -0,0 +1,163 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009-2014, Nominet UK.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Nominet UK nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY Nominet UK ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Nominet UK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * microbenchmark of the wire format domain name functions in dname.c
+ * against the equivalent ldns routines
+ *
+ * usage: dnamebench [iterations]
+ *
+ * set EVLDNS_DNAME_IMPL to "scalar", "sse2" or "avx2" to compare the
+ * different implementations
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <evldns.h>
+
+#define NNAMES		1024
+
+static ldns_rdf		*names[NNAMES];
+static ldns_rdf		*lower[NNAMES];
+static volatile uint32_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, double start, long iterations)
+{
+	double ns = (now() - start) * 1e9 / ((double)iterations * NNAMES);
+	printf("%-32s %8.2f ns/name\n", what, ns);
+}
+
+/* a mix of short and long names in mixed case */
+static void make_names(void)
+{
+	char buf[256];
+	int i;
+
+	for (i = 0; i < NNAMES; ++i) {
+		if (i % 4 == 3) {
+			snprintf(buf, sizeof(buf),
+				"Host-%d.Rack-%d.Row-%d.DataCentre.Region-%d.Customer-%d.Example.NET.",
+				i, i % 40, i % 7, i % 3, i);
+		} else {
+			snprintf(buf, sizeof(buf), "WWW.Customer-%d.Example.COM.", i);
+		}
+		names[i] = ldns_dname_new_frm_str(buf);
+		lower[i] = ldns_dname_clone_from(names[i], 0);
+		ldns_dname2canonical(lower[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = (argc > 1) ? atol(argv[1]) : 10000;
+	uint8_t buf[LDNS_MAX_DOMAINLEN + 1];
+	ldns_rdf tmp;
+	double start;
+	long n;
+	int i;
+
+	make_names();
+	printf("%d names x %ld iterations, using %s\n\n", NNAMES, iterations,
+		evldns_dname_impl());
+
+	/* what the dispatcher used to do for each query */
+	start = now();
+	for (n = 0; n < iterations; ++n) {
+		for (i = 0; i < NNAMES; ++i) {
+			ldns_rdf *q = ldns_dname_clone_from(names[i], 0);
+			ldns_dname2canonical(q);
+			sink += ldns_rdf_data(q)[1];
+			ldns_rdf_deep_free(q);
+		}
+	}
+	report("ldns clone + dname2canonical", start, iterations);
+
+	ldns_rdf_set_type(&tmp, LDNS_RDF_TYPE_DNAME);
+	ldns_rdf_set_data(&tmp, buf);
+	start = now();
+	for (n = 0; n < iterations; ++n) {
+		for (i = 0; i < NNAMES; ++i) {
+			size_t len = ldns_rdf_size(names[i]);
+			memcpy(buf, ldns_rdf_data(names[i]), len);
+			ldns_rdf_set_size(&tmp, len);
+			ldns_dname2canonical(&tmp);
+			sink += buf[1];
+		}
+	}
+	report("ldns copy + dname2canonical", start, iterations);
+
+	start = now();
+	for (n = 0; n < iterations; ++n) {
+		for (i = 0; i < NNAMES; ++i) {
+			evldns_dname_canonical(buf, ldns_rdf_data(names[i]),
+				ldns_rdf_size(names[i]));
+			sink += buf[1];
+		}
+	}
+	report("evldns_dname_canonical", start, iterations);
+
+	start = now();
+	for (n = 0; n < iterations; ++n) {
+		for (i = 0; i < NNAMES; ++i) {
+			sink += evldns_dname_canonical_hash(buf, ldns_rdf_data(names[i]),
+				ldns_rdf_size(names[i]));
+		}
+	}
+	report("evldns_dname_canonical_hash", start, iterations);
+
+	start = now();
+	for (n = 0; n < iterations; ++n) {
+		for (i = 0; i < NNAMES; ++i) {
+			sink += ldns_dname_compare(names[i], lower[i]);
+		}
+	}
+	report("ldns_dname_compare", start, iterations);
+
+	start = now();
+	for (n = 0; n < iterations; ++n) {
+		for (i = 0; i < NNAMES; ++i) {
+			sink += evldns_dname_equal(ldns_rdf_data(names[i]),
+				ldns_rdf_size(names[i]), ldns_rdf_data(lower[i]),
+				ldns_rdf_size(lower[i]));
+		}
+	}
+	report("evldns_dname_equal", start, iterations);
+
+	return EXIT_SUCCESS;
+}
@@ -31,17 +31,137 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/queue.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <evldns.h>
 
+/* room for the ancillary data evldns asks for on UDP sockets */
+#define EVLDNS_CMSG_SPACE		128
+
+union evldns_cmsgbuf {
+	struct cmsghdr					 hdr;
+	uint8_t							 buf[EVLDNS_CMSG_SPACE];
+};
+
+/* the local address a UDP response should be sent from */
+struct evldns_srcaddr {
+	sa_family_t						 family;	/* AF_UNSPEC if not known */
+	unsigned int					 ifindex;
+	union {
+		struct in_addr				 v4;
+		struct in6_addr				 v6;
+	} a;
+};
+typedef struct evldns_srcaddr evldns_srcaddr;
+
+/* a chained hash table - entries start with a struct evldns_hnode */
+struct evldns_hnode {
+	struct evldns_hnode				*hnext;
+	uint32_t						 hash;
+};
+
+struct evldns_htable {
+	struct evldns_hnode			   **buckets;
+	unsigned int					 size;
+	unsigned int					 count;
+};
+
+/* callback entries in registration order, linked through 'inext' */
+struct evldns_cblist {
+	struct evldns_cb				*first;
+	struct evldns_cb				*last;
+};
+
+/* the exact-name callbacks for one (name, class, type) */
+struct evldns_cbkey {
+	struct evldns_hnode				 h;
+	const uint8_t					*name;
+	size_t							 name_len;
+	ldns_rr_class					 rr_class;
+	ldns_rr_type					 rr_type;
+	struct evldns_cblist			 list;
+};
+
+/*
+ * a node in the reversed-label trie of wildcard callbacks, holding the
+ * "*.<name>" entries for the name it represents.  Children are found
+ * through the server's 'cb_trie' table, keyed on (parent, label).
+ */
+struct evldns_cbnode {
+	struct evldns_hnode				 h;
+	struct evldns_cbnode			*parent;
+	uint8_t							 label[LDNS_MAX_LABELLEN + 1];
+	struct evldns_cblist			 list;
+};
+
 struct evldns_server {
 	struct event_base				*base;
+	struct evldns_server			*root;		/* owner of the callback table */
 	TAILQ_HEAD(evldnscbq, evldns_cb) callbacks;
+
+	/* the index of 'callbacks' used to dispatch requests */
+	unsigned int					 cb_seq;
+	struct evldns_htable			 cb_exact;
+	struct evldns_htable			 cb_trie;
+	struct evldns_cbnode			 cb_wild_root;
+	struct evldns_cblist			 cb_all;
+
+	/* a compiled matcher - see evldns_set_matcher() */
+	evldns_matcher					 matcher;
+	void							*matcher_data;
+
+	/* run on each wire format response - see evldns_add_post_hook() */
+	TAILQ_HEAD(evldnshkq, evldns_hook) post_hooks;
+	TAILQ_HEAD(evldnsspq, evldns_server_port) ports;
+
+	/* busy polling - see evldns_server_poll() */
+	volatile int					 poll_stop;
+	uint64_t						 poll_spins;
+	uint64_t						 poll_busy;
+	uint64_t						 poll_sleeps;
+
+	/* per-wakeup I/O budgets - see evldns_set_io_budget() */
+	unsigned int					 budget;
+	unsigned int					 udp_weight;
+	unsigned int					 tcp_weight;
+
+	/* answer anything but single-question QUERYs with an error */
+	int								 query_only;
+
+	/* process batches one stage at a time - see evldns_set_pipeline() */
+	int								 pipeline;
+
+	/* the largest UDP response for EDNS clients - see evldns_set_udp_max() */
+	uint16_t						 udp_max;
+
+	/* the dispatch memo - see evldns_set_dispatch_cache() */
+	struct evldns_memo				*memo;
+	unsigned int					 memo_size;
+	uint64_t						 memo_hits;
+	uint64_t						 memo_misses;
+
+	/* the response cache - see evldns_set_response_cache() */
+	struct evldns_rcache			*rcache;
+	unsigned int					 rcache_size;
+	uint32_t						 rcache_ttl;
+	uint64_t						 rcache_hits;
+	uint64_t						 rcache_misses;
+	uint64_t						 rcache_stores;
 };
 typedef struct evldns_server evldns_server;
 
@@ -51,22 +171,88 @@ struct evldns_server_port {
 	int								 socket;
 	int								 refcnt;
 	struct event					*event;
-	TAILQ_HEAD(evldnssrq, evldns_server_request) pending;
+	short							 events;
+	struct sockaddr_storage			 sockname;
 	unsigned int					 is_tcp:1;
 	unsigned int					 closing:1;
+
+	/* datagrams received, and dropped by the kernel (SO_RXQ_OVFL) */
+	uint64_t						 rx_packets;
+	uint32_t						 kernel_drops;
+
+	/* this port's share of the server's I/O budget */
+	unsigned int					 weight;
+	uint64_t						 budget_exhausted;
+
+	/* UDP responses awaiting send - see evldns_set_send_queue() */
+	struct evldns_pending			*sendq;
+	unsigned int					 sendq_cap;
+	unsigned int					 sendq_head;
+	unsigned int					 sendq_count;
+	unsigned int					 sendq_high_water;
+	enum evldns_queue_policy		 sendq_policy;
+	unsigned int					 sendq_stopped:1;
+	uint64_t						 sendq_drops;
+	uint64_t						 sendq_stalls;
+
+	/* batched UDP I/O - see evldns_set_batch_size() */
+	unsigned int					 batch_max;
+	unsigned int					 batch_size;
+	unsigned int					 batch_adaptive:1;
+
+	/* recycled UDP request objects - see evldns_set_request_pool() */
+	TAILQ_HEAD(evldnsfrq, evldns_server_request) free_reqs;
+	size_t							 pool_bufsize;
+	unsigned int					 pool_size;
+	unsigned int					 pool_free;
+	unsigned int					 pool_in_use;
+
+	/* open TCP connections, closed by evldns_free_server() */
+	TAILQ_HEAD(evldnscrq, evldns_server_request) conns;
+	unsigned int					 pool_high_water;
+	uint64_t						 pool_allocs;
+	uint64_t						 pool_reuses;
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	struct mmsghdr					*batch_msgs;
+	struct iovec					*batch_iov;
+	evldns_server_request			**batch_reqs;
+	evldns_server_request			**batch_resp;
+	int								*batch_result;
+	union evldns_cmsgbuf			*batch_cmsg;
+#endif
 };
 typedef struct evldns_server_port evldns_server_port;
 
+/* a compact queued UDP response - just the destination and the data */
+struct evldns_pending {
+	struct sockaddr_storage			 addr;
+	socklen_t						 addrlen;
+	evldns_srcaddr					 src;
+	size_t							 len;
+	uint8_t							*wire;
+};
+typedef struct evldns_pending evldns_pending;
+
 struct evldns_cb {
 	TAILQ_ENTRY(evldns_cb)			 next;
+	struct evldns_cb				*inext;		/* within its index list */
+	unsigned int					 seq;		/* registration order */
 	ldns_rdf						*rdf;
 	ldns_rr_type					 rr_type;
 	ldns_rr_class					 rr_class;
 	evldns_callback					 callback;
+	evldns_name_callback			 name_callback;
+	evldns_wire_callback			 wire_callback;
 	void							*data;
 };
 typedef struct evldns_cb evldns_cb;
 
+struct evldns_hook {
+	TAILQ_ENTRY(evldns_hook)		 next;
+	evldns_post_hook				 hook;
+	void							*data;
+};
+
 /* forward declarations */
 static void evldns_tcp_accept_callback(int fd, short events, void *arg);
 static void evldns_tcp_read_callback(int fd, short events, void *arg);
@@ -75,10 +261,31 @@ static void evldns_tcp_write_callback(int fd, short events, void *arg);
 static void evldns_udp_callback(int fd, short events, void *arg);
 static void evldns_udp_read_callback(evldns_server_port *port);
 static void evldns_udp_write_callback(evldns_server_port *port);
-
+static void evldns_udp_update_events(evldns_server_port *port);
+static void evldns_udp_queue_pending(evldns_server_request *req);
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+static void evldns_udp_read_batch(evldns_server_port *port);
+static void evldns_udp_write_batch(evldns_server_port *port, evldns_server_request **reqs, unsigned int count);
+static void evldns_udp_flush_batch(evldns_server_port *port);
+#endif
+
+static int evldns_tcp_add_connection(evldns_server_port *port, int socket, struct sockaddr *addr, socklen_t addrlen);
+static void evldns_tcp_cleanup(evldns_server_request *req);
+
+static void server_port_cmsg(evldns_server_port *port, evldns_server_request *req, struct cmsghdr *cmsg);
+static void server_port_msghdr(evldns_server_port *port, evldns_server_request *req, struct msghdr *msg);
+static void server_request_srcaddr(evldns_server_request *req, evldns_srcaddr *src);
+static void server_send_msghdr(struct msghdr *msg, struct iovec *iov, union evldns_cmsgbuf *cbuf, uint8_t *wire, size_t len, struct sockaddr_storage *addr, socklen_t addrlen, const evldns_srcaddr *src);
 static void server_port_free(evldns_server_port *port);
+static evldns_server_request *server_request_alloc(evldns_server_port *port);
+static void server_request_put(evldns_server_request *req);
+static void arena_reset(evldns_server_request *req);
+static void arena_free(struct evldns_arena_chunk *chunk);
 static int server_request_free(evldns_server_request *req);
 static int server_process_packet(evldns_server_request *req);
+static void server_process_batch(evldns_server_request **reqs, int *results, int count);
+static int server_index_cb(evldns_server *root, evldns_cb *cb);
+static int server_error_response(evldns_server_request *req, ldns_pkt_rcode rcode);
 
 /* exported function */
 struct evldns_server *evldns_add_server(struct event_base *base)
@@ -88,7 +295,43 @@ struct evldns_server *evldns_add_server(struct event_base *base)
 		return NULL;
 	}
 	server->base = base;
+	server->root = server;
 	TAILQ_INIT(&server->callbacks);
+	TAILQ_INIT(&server->post_hooks);
+	TAILQ_INIT(&server->ports);
+	server->budget = EVLDNS_DEFAULT_BUDGET;
+	server->udp_weight = 1;
+	server->tcp_weight = 1;
+	server->query_only = 1;
+	server->udp_max = EVLDNS_UDP_MAX_DEFAULT;
+
+	return server;
+}
+
+/*
+ * creates a server that uses (but doesn't copy) the callback table of
+ * 'parent', e.g. for a worker thread with its own event_base.  The
+ * table must not be changed while any such server is running.
+ */
+struct evldns_server *evldns_add_server_shared(struct event_base *base, struct evldns_server *parent)
+{
+	evldns_server *server = evldns_add_server(base);
+	if (server) {
+		server->root = parent->root;
+		server->budget = parent->budget;
+		server->udp_weight = parent->udp_weight;
+		server->tcp_weight = parent->tcp_weight;
+		server->query_only = parent->query_only;
+		server->pipeline = parent->pipeline;
+		server->udp_max = parent->udp_max;
+		if (parent->rcache_size) {
+			(void)evldns_set_response_cache(server, parent->rcache_size,
+				parent->rcache_ttl);
+		}
+		if (parent->memo_size) {
+			(void)evldns_set_dispatch_cache(server, parent->memo_size);
+		}
+	}
 
 	return server;
 }
@@ -112,17 +355,29 @@ evldns_add_server_port(struct evldns_server *server, int socket)
 	port->socket = socket;
 	port->refcnt = 1;
 	port->is_tcp = socket_is_tcp(socket);
+	socklen_t namelen = sizeof(port->sockname);
+	(void)getsockname(socket, (struct sockaddr *)&port->sockname, &namelen);
+	port->weight = 1;
+	port->batch_max = 1;
+	port->batch_size = 1;
+	port->pool_bufsize = EVLDNS_POOL_BUFSIZE;
+	port->pool_size = port->is_tcp ? 0 : EVLDNS_POOL_DEFAULT;
+	TAILQ_INIT(&port->free_reqs);
+	TAILQ_INIT(&port->conns);
+	port->sendq_cap = EVLDNS_SENDQ_DEFAULT;
+	port->sendq_policy = EVLDNS_QUEUE_DROP_NEWEST;
+	TAILQ_INSERT_TAIL(&server->ports, port, next);
 
 	/* and set it up for libevent */
 	if (port->is_tcp) {
 		callback = evldns_tcp_accept_callback;
 	} else {
 		callback = evldns_udp_callback;
-		TAILQ_INIT(&port->pending);		// only needed for UDP
 	}
 
+	port->events = EV_READ | EV_PERSIST;
 	port->event = event_new(port->server->base, port->socket,
-		EV_READ | EV_PERSIST, callback, port);
+		port->events, callback, port);
 	event_add(port->event, NULL);
 
 	return port;
@@ -136,6 +391,212 @@ evldns_add_server_ports(struct evldns_server *server, const int *sockets)
 	}
 }
 
+void
+evldns_set_io_budget(evldns_server *server, unsigned int budget, unsigned int udp_weight, unsigned int tcp_weight)
+{
+	server->budget = budget;
+	server->udp_weight = udp_weight ? udp_weight : 1;
+	server->tcp_weight = tcp_weight ? tcp_weight : 1;
+}
+
+/*
+ * by default requests with OPCODE != QUERY get NOTIMPL, and those with
+ * QDCOUNT != 1 get FORMERR, before any callbacks are called.  Servers
+ * that handle other opcodes (e.g. NOTIFY) can turn that off.
+ */
+void
+evldns_set_query_only(evldns_server *server, int enable)
+{
+	server->query_only = enable;
+}
+
+/*
+ * in pipelined mode each batch of UDP requests read with recvmmsg() is
+ * parsed, then dispatched, then serialised, one stage at a time, so
+ * that each stage's code and data stay in cache across the batch
+ */
+void
+evldns_set_pipeline(evldns_server *server, int enable)
+{
+	server->pipeline = enable;
+}
+
+/*
+ * sets the largest UDP response sent to EDNS clients, whatever their
+ * buffer size, and the size advertised in OPT RRs - clients without
+ * EDNS always get at most 512 bytes.  Cached responses were fitted to
+ * (and advertise) the old size, so the response cache is emptied.
+ */
+void
+evldns_set_udp_max(evldns_server *server, uint16_t size)
+{
+	server->udp_max = (size < 512) ? 512 : size;
+	if (server->rcache_size) {
+		(void)evldns_set_response_cache(server, server->rcache_size,
+			server->rcache_ttl);
+	}
+}
+
+void
+evldns_set_port_weight(evldns_server_port *port, unsigned int weight)
+{
+	port->weight = weight ? weight : 1;
+}
+
+/*
+ * the maximum number of packets (or connections) a port may handle
+ * per event loop wakeup before yielding to other events, or 0 for
+ * no limit
+ */
+static unsigned int
+port_budget(evldns_server_port *port)
+{
+	evldns_server *server = port->server;
+
+	return server->budget * port->weight *
+		(port->is_tcp ? server->tcp_weight : server->udp_weight);
+}
+
+int
+evldns_set_batch_size(evldns_server_port *port, unsigned int size, int adaptive)
+{
+	if (port->is_tcp) return -1;
+	if (size < 1) size = 1;
+	if (size > EVLDNS_MAX_BATCH) size = EVLDNS_MAX_BATCH;
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	/*
+	 * the per-port message arrays are sized for the largest batch
+	 * so that adaptive mode never needs to reallocate them
+	 */
+	if (size > 1 && !port->batch_msgs) {
+		port->batch_msgs = calloc(EVLDNS_MAX_BATCH, sizeof(struct mmsghdr));
+		port->batch_iov = calloc(EVLDNS_MAX_BATCH, sizeof(struct iovec));
+		port->batch_reqs = calloc(EVLDNS_MAX_BATCH, sizeof(evldns_server_request *));
+		port->batch_resp = calloc(EVLDNS_MAX_BATCH, sizeof(evldns_server_request *));
+		port->batch_result = calloc(EVLDNS_MAX_BATCH, sizeof(int));
+		port->batch_cmsg = calloc(EVLDNS_MAX_BATCH, sizeof(union evldns_cmsgbuf));
+		if (!port->batch_msgs || !port->batch_iov || !port->batch_reqs ||
+			!port->batch_resp || !port->batch_result || !port->batch_cmsg)
+		{
+			perror("calloc");
+			free(port->batch_msgs);
+			free(port->batch_iov);
+			free(port->batch_reqs);
+			free(port->batch_resp);
+			free(port->batch_result);
+			free(port->batch_cmsg);
+			port->batch_msgs = NULL;
+			port->batch_iov = NULL;
+			port->batch_reqs = NULL;
+			port->batch_resp = NULL;
+			port->batch_result = NULL;
+			port->batch_cmsg = NULL;
+			return -1;
+		}
+	}
+#else
+	size = 1;
+#endif
+
+	port->batch_max = size;
+	port->batch_size = adaptive ? 1 : size;
+	port->batch_adaptive = adaptive ? 1 : 0;
+
+	return 0;
+}
+
+int
+evldns_set_request_pool(evldns_server_port *port, unsigned int size, size_t bufsize)
+{
+	evldns_server_request *req;
+
+	if (port->is_tcp) return -1;
+	if (bufsize == 0) bufsize = EVLDNS_POOL_BUFSIZE;
+	if (bufsize > LDNS_MAX_PACKETLEN) bufsize = LDNS_MAX_PACKETLEN;
+
+	/*
+	 * requests that are out of the pool (in flight, or waiting in the
+	 * batch arrays) keep their buffers, and receives into them use
+	 * pool_bufsize, so the size can't change while there are any
+	 */
+	if (bufsize != port->pool_bufsize && port->pool_in_use) {
+		return -1;
+	}
+
+	/* buffers already on the free list may be the wrong size */
+	while ((req = TAILQ_FIRST(&port->free_reqs)) != NULL) {
+		TAILQ_REMOVE(&port->free_reqs, req, next);
+		arena_free(req->arena);
+		free(req->wire_request);
+		free(req);
+	}
+	port->pool_free = 0;
+	port->pool_bufsize = bufsize;
+	port->pool_size = size;
+
+	/* preallocate the whole pool */
+	while (port->pool_free < size) {
+		if (!(req = calloc(1, sizeof(*req)))) {
+			perror("calloc");
+			return -1;
+		}
+		if (!(req->wire_request = malloc(bufsize))) {
+			perror("malloc");
+			free(req);
+			return -1;
+		}
+		req->pooled = 1;
+		TAILQ_INSERT_TAIL(&port->free_reqs, req, next);
+		port->pool_free++;
+	}
+
+	return 0;
+}
+
+int
+evldns_set_send_queue(evldns_server_port *port, unsigned int size, enum evldns_queue_policy policy)
+{
+	if (port->is_tcp) return -1;
+	if (size < 1) size = 1;
+
+	/* the ring is only (re)allocated once it's empty */
+	if (port->sendq_count) return -1;
+
+	free(port->sendq);
+	port->sendq = NULL;
+	port->sendq_head = 0;
+	port->sendq_cap = size;
+	port->sendq_policy = policy;
+
+	return 0;
+}
+
+void
+evldns_get_port_stats(evldns_server_port *port, struct evldns_port_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->pool_size = port->pool_size;
+	stats->pool_bufsize = port->pool_bufsize;
+	stats->pool_free = port->pool_free;
+	stats->pool_in_use = port->pool_in_use;
+	stats->pool_high_water = port->pool_high_water;
+	stats->pool_allocs = port->pool_allocs;
+	stats->pool_reuses = port->pool_reuses;
+	stats->rx_packets = port->rx_packets;
+	stats->kernel_drops = port->kernel_drops;
+	if (!port->is_tcp) {
+		(void)socket_drop_count(port->socket, &stats->socket_drops);
+	}
+	stats->budget = port_budget(port);
+	stats->budget_exhausted = port->budget_exhausted;
+	stats->sendq_cap = port->sendq_cap;
+	stats->sendq_len = port->sendq_count;
+	stats->sendq_high_water = port->sendq_high_water;
+	stats->sendq_drops = port->sendq_drops;
+	stats->sendq_stalls = port->sendq_stalls;
+}
+
 void
 evldns_close_server_port(evldns_server_port *port)
 {
@@ -146,34 +607,100 @@ evldns_close_server_port(evldns_server_port *port)
 	}
 }
 
+/*
+ * frees a server and its ports, closing any open TCP connections, so
+ * that its event_base can then be freed.  The ports' own sockets are
+ * left open for the caller that bound them.  The callback table and
+ * post hooks aren't touched, as a shared server (e.g. a worker's) only
+ * borrows those of its parent.
+ */
+void
+evldns_free_server(evldns_server *server)
+{
+	evldns_server_port *port;
+	evldns_server_request *req;
+
+	while ((port = TAILQ_FIRST(&server->ports)) != NULL) {
+		while ((req = TAILQ_FIRST(&port->conns)) != NULL) {
+			evldns_tcp_cleanup(req);
+		}
+		server_port_free(port);
+	}
+
+	free(server->memo);
+	(void)evldns_set_response_cache(server, 0, 0);
+	free(server);
+}
+
 /*-------------------------------------------------------------------*/
 
 static void
 evldns_tcp_accept_callback(int fd, short events, void *arg)
 {
-	struct timeval tv = { 120, 0 };
 	evldns_server_port *port = (evldns_server_port *)arg;
+	unsigned int budget = port_budget(port), count;
+
+	/* accept as many connections as the port's budget allows */
+	for (count = 0; !budget || count < budget; ++count) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		int socket = accept(fd, (struct sockaddr *)&addr, &addrlen);
+		if (socket < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("accept");
+			}
+			return;
+		}
+
+		(void)evldns_tcp_add_connection(port, socket, (struct sockaddr *)&addr, addrlen);
+	}
+
+	port->budget_exhausted++;
+}
+
+/*
+ * sets up the request object and read event for a newly accepted
+ * TCP connection
+ */
+static int
+evldns_tcp_add_connection(evldns_server_port *port, int socket, struct sockaddr *addr, socklen_t addrlen)
+{
+	struct timeval tv = { 120, 0 };
 	evldns_server_request *req = calloc(1, sizeof(evldns_server_request));
 	if (!req) {
 		perror("calloc");
-		return;
+		close(socket);
+		return -1;
 	}
 
 	req->port = port;
-	req->addrlen = sizeof(struct sockaddr_storage);
-	req->socket = accept(fd, (struct sockaddr *)&req->addr, &req->addrlen);
+	req->socket = socket;
 	req->is_tcp = 1;
+	if (addrlen > sizeof(req->addr)) {
+		addrlen = sizeof(req->addr);
+	}
+	memcpy(&req->addr, addr, addrlen);
+	req->addrlen = addrlen;
+
+	/* accepted sockets don't inherit the listener's O_NONBLOCK */
+	if (fcntl(req->socket, F_SETFL, O_NONBLOCK) < 0) {
+		perror("fcntl");
+	}
 
 	/* create event on new socket and register that event */
 	req->event = event_new(req->port->server->base, req->socket, EV_READ | EV_PERSIST,
 			evldns_tcp_read_callback, req);
 	event_add(req->event, &tv);
+	TAILQ_INSERT_TAIL(&port->conns, req, next);
+
+	return 0;
 }
 
 /*-------------------------------------------------------------------*/
 
 static void evldns_tcp_cleanup(evldns_server_request *req)
 {
+	TAILQ_REMOVE(&req->port->conns, req, next);
 	event_del(req->event);
 	shutdown(req->socket, SHUT_RDWR);
 	close(req->socket);
@@ -190,10 +717,12 @@ evldns_tcp_write_packet(evldns_server_request *req)
 	 */
 	if (req->wire_resphead < 2) {
 		struct iovec iov[2];
-		uint16_t len = htons(req->wire_resplen);
+		uint8_t len[2];
+		size_t head = 2 - req->wire_resphead;
 
-		iov[0].iov_base = &len + req->wire_resphead;
-		iov[0].iov_len = sizeof(len) - req->wire_resphead;
+		ldns_write_uint16(len, req->wire_resplen);
+		iov[0].iov_base = len + req->wire_resphead;
+		iov[0].iov_len = head;
 
 		iov[1].iov_base = req->wire_response;
 		iov[1].iov_len = req->wire_resplen;
@@ -208,11 +737,13 @@ evldns_tcp_write_packet(evldns_server_request *req)
 			}
 		} else if (r == 0) {
 			return 0;
-		} else if (r == 1) {
-			req->wire_resphead = 1;
-		} else if (r >= 2) {
+		} else if ((size_t)r < head) {
+			/* only part of the header went - don't start the body */
+			req->wire_resphead += r;
+			return 0;
+		} else {
 			req->wire_resphead = 2;
-			req->wire_respdone = req->wire_resplen - r - 2;
+			req->wire_respdone = r - head;
 		}
 	}
 
@@ -248,13 +779,15 @@ evldns_tcp_write_packet(evldns_server_request *req)
 		 * request - without this it'll loop
 		 */
 		ldns_pkt_free(req->response);
-		if (req->wire_response) {
+		if (req->wire_response && !req->wire_arena) {
 			free(req->wire_response);
 		}
 		req->response = 0;
 		req->wire_response = 0;
+		req->wire_arena = 0;
 		req->wire_reqdone = 0;
 		req->wire_reqlen = 0;
+		arena_reset(req);
 
 		struct timeval tv = { 120, 0 };
 		(void)event_del(req->event);
@@ -415,37 +948,156 @@ evldns_udp_callback(int fd, short events, void *arg)
 	}
 }
 
+static void
+evldns_udp_update_events(evldns_server_port *port)
+{
+	short events = EV_PERSIST;
+
+	/*
+	 * read unless the port is closing or the send queue has asked
+	 * for backpressure, and write while there's anything queued
+	 */
+	if (!port->closing && !port->sendq_stopped) {
+		events |= EV_READ;
+	}
+	if (port->sendq_count) {
+		events |= EV_WRITE;
+	}
+
+	if (events == port->events) {
+		return;
+	}
+
+	(void)event_del(port->event);
+	(void)event_assign(port->event, port->server->base, port->socket,
+		events, evldns_udp_callback, port);
+	if (event_add(port->event, NULL) < 0) {
+		// TODO: warn
+	}
+	port->events = events;
+}
+
+static void
+evldns_udp_sendq_pop(evldns_server_port *port)
+{
+	evldns_pending *p = &port->sendq[port->sendq_head];
+
+	free(p->wire);
+	p->wire = NULL;
+	port->sendq_head = (port->sendq_head + 1) % port->sendq_cap;
+	port->sendq_count--;
+}
+
+/*
+ * moves an unsent response onto the port's send queue, keeping only
+ * the client address and the wire data, and disposes of the request
+ */
+static void
+evldns_udp_queue_pending(evldns_server_request *req)
+{
+	evldns_server_port *port = req->port;
+	evldns_pending *p;
+
+	if (!port->sendq) {
+		port->sendq = calloc(port->sendq_cap, sizeof(evldns_pending));
+		if (!port->sendq) {
+			perror("calloc");
+			port->sendq_drops++;
+			server_request_free(req);
+			return;
+		}
+	}
+
+	/*
+	 * apply the overflow policy if the queue is full - with
+	 * EVLDNS_QUEUE_STOP_READING this only happens to responses
+	 * already in progress when reading was suspended
+	 */
+	if (port->sendq_count == port->sendq_cap) {
+		port->sendq_drops++;
+		if (port->sendq_policy == EVLDNS_QUEUE_DROP_OLDEST) {
+			evldns_udp_sendq_pop(port);
+		} else {
+			server_request_free(req);
+			return;
+		}
+	}
+
+	p = &port->sendq[(port->sendq_head + port->sendq_count) % port->sendq_cap];
+	memcpy(&p->addr, &req->addr, req->addrlen);
+	p->addrlen = req->addrlen;
+	server_request_srcaddr(req, &p->src);
+	p->len = req->wire_resplen;
+	if (req->wire_arena) {
+		/* the arena goes with the request, so take a copy */
+		if (!(p->wire = malloc(p->len))) {
+			perror("malloc");
+			server_request_free(req);
+			return;
+		}
+		memcpy(p->wire, req->wire_response, p->len);
+	} else {
+		p->wire = req->wire_response;
+		req->wire_response = NULL;
+	}
+	server_request_free(req);
+
+	if (++port->sendq_count > port->sendq_high_water) {
+		port->sendq_high_water = port->sendq_count;
+	}
+
+	if (port->sendq_count == port->sendq_cap &&
+		port->sendq_policy == EVLDNS_QUEUE_STOP_READING &&
+		!port->sendq_stopped)
+	{
+		port->sendq_stopped = 1;
+		port->sendq_stalls++;
+	}
+
+	evldns_udp_update_events(port);
+}
+
 static int
 evldns_server_udp_write_queue(evldns_server_request *req)
 {
 	evldns_server_port *port = req->port;
+	union evldns_cmsgbuf cmsgbuf;
+	evldns_srcaddr src;
+	struct msghdr msg;
+	struct iovec iov;
 	int		r;
 
+	/*
+	 * older responses go first - if they can't all be sent now this
+	 * one has to wait behind them
+	 */
+	if (port->sendq_count) {
+		evldns_udp_write_callback(port);
+		if (port->sendq_count) {
+			evldns_udp_queue_pending(req);
+			return 1;
+		}
+	}
+
 	/*
 	 * try and send the datagram immediately
 	 */
-	r = sendto(req->socket, req->wire_response, req->wire_resplen, 0,
-		   (struct sockaddr *) &req->addr, req->addrlen);
+	server_request_srcaddr(req, &src);
+	server_send_msghdr(&msg, &iov, &cmsgbuf, req->wire_response, req->wire_resplen,
+		&req->addr, req->addrlen, &src);
+	r = sendmsg(req->socket, &msg, 0);
 
 	/*
 	 * if it failed, queue it for later
 	 */
 	if (r < 0) {
 		if (errno != EAGAIN) {
-			perror("sendto");
+			perror("sendmsg");
+			server_request_free(req);
 			return -1;
 		}
 
-		TAILQ_INSERT_TAIL(&port->pending, req, next);
-		if (TAILQ_FIRST(&port->pending) == req) {
-			(void)event_del(port->event);
-			(void)event_assign(port->event, port->server->base, port->socket,
-				  (port->closing ? 0 : EV_READ) | EV_WRITE | EV_PERSIST,
-				  evldns_udp_callback, port);
-			if (event_add(port->event, NULL) < 0) {
-				// TODO: warn
-			}
-		}
+		evldns_udp_queue_pending(req);
 
 		return 1;
 	}
@@ -453,16 +1105,7 @@ evldns_server_udp_write_queue(evldns_server_request *req)
 	/*
 	 * dispose of the current request - only reached if the original send succeeds
 	 */
-	if (server_request_free(req)) {
-		return 0;
-	}
-
-	/*
-	 * and send anything else that happens to be in the queue
-	 */
-	if (!TAILQ_EMPTY(&port->pending)) {
-		evldns_udp_write_callback(port);
-	}
+	server_request_free(req);
 
 	return 0;
 }
@@ -470,35 +1113,61 @@ evldns_server_udp_write_queue(evldns_server_request *req)
 static void
 evldns_udp_read_callback(evldns_server_port *port)
 {
-	while (1) {
-		evldns_server_request *req = calloc(1, sizeof(evldns_server_request));
-		if (!req) {
-			perror("calloc");
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	if (port->batch_max > 1) {
+		evldns_udp_read_batch(port);
+		return;
+	}
+#endif
+
+	unsigned int budget = port_budget(port), count = 0;
+
+	while (!port->sendq_stopped) {
+		union evldns_cmsgbuf cmsgbuf;
+		struct msghdr msg;
+		struct iovec iov;
+		evldns_server_request *req;
+
+		/* leave the rest for the next loop so other events get a turn */
+		if (budget && count++ >= budget) {
+			port->budget_exhausted++;
 			return;
 		}
 
-		req->wire_request = malloc(LDNS_MAX_PACKETLEN);
-		if (!req->wire_request) {
-			free(req);
-			perror("malloc");
+		req = server_request_alloc(port);
+		if (!req) {
 			return;
 		}
 
-		req->addrlen = sizeof(struct sockaddr_storage);
-		req->socket = port->socket;
-		req->port = port;
+		iov.iov_base = req->wire_request;
+		iov.iov_len = port->pool_bufsize;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &req->addr;
+		msg.msg_namelen = sizeof(struct sockaddr_storage);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf);
 
-		ssize_t buflen = recvfrom(req->socket, req->wire_request, LDNS_MAX_PACKETLEN, 0,
-					  (struct sockaddr *)&req->addr, &req->addrlen);
+		ssize_t buflen = recvmsg(req->socket, &msg, 0);
 		if (buflen < 0) {
 			if (errno != EAGAIN) {
-				perror("recvfrom");
+				perror("recvmsg");
 			}
-			free(req->wire_request);
-			free(req);
+			server_request_put(req);
 			return;
 		}
+		req->addrlen = msg.msg_namelen;
 		req->wire_reqlen = (uint16_t)buflen;
+		port->rx_packets++;
+		server_port_msghdr(port, req, &msg);
+
+		/* ignore anything too big for the receive buffer */
+		if (msg.msg_flags & MSG_TRUNC) {
+			server_request_put(req);
+			continue;
+		}
 
 		if (server_process_packet(req) >= 0) {
 			evldns_server_udp_write_queue(req);
@@ -511,163 +1180,2146 @@ evldns_udp_read_callback(evldns_server_port *port)
 static void
 evldns_udp_write_callback(evldns_server_port *port)
 {
-	struct evldns_server_request *req;
-	TAILQ_FOREACH(req, &port->pending, next) {
-
-		int r = sendto(port->socket, req->wire_response, req->wire_resplen, 0,
-			(struct sockaddr *)&req->addr, req->addrlen);
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	if (port->batch_max > 1) {
+		evldns_udp_flush_batch(port);
+	} else
+#endif
+	while (port->sendq_count) {
+		evldns_pending *p = &port->sendq[port->sendq_head];
+		union evldns_cmsgbuf cmsgbuf;
+		struct msghdr msg;
+		struct iovec iov;
+
+		server_send_msghdr(&msg, &iov, &cmsgbuf, p->wire, p->len,
+			&p->addr, p->addrlen, &p->src);
+		int r = sendmsg(port->socket, &msg, 0);
 
 		if (r < 0) {
 			if (errno == EAGAIN) {
-				return;
+				break;
 			}
-			perror("sendto");
+			perror("sendmsg");
 		}
 
-		TAILQ_REMOVE(&port->pending, req, next);
-		if (server_request_free(req)) {
-			return;
-		}
+		evldns_udp_sendq_pop(port);
 	}
 
-	/* no more write events pending - go back to read-only mode */
-	(void)event_del(port->event);
-	(void)event_assign(port->event, port->server->base, port->socket,
-		EV_READ | EV_PERSIST, evldns_udp_callback, port);
-	if (event_add(port->event, NULL) < 0) {
-		// TODO: warn
+	/* resume reading once the queue has drained far enough */
+	if (port->sendq_stopped && port->sendq_count <= port->sendq_cap / 2) {
+		port->sendq_stopped = 0;
 	}
+
+	evldns_udp_update_events(port);
 }
 
-/*-------------------------------------------------------------------*/
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
 
-ldns_pkt *
+/*
+ * sends a batch of responses with as few sendmmsg() calls as possible,
+ * queueing whatever the kernel won't take right now.  Responses still
+ * on the send queue are sent first, and if they can't all go the new
+ * ones are queued behind them so that nothing is reordered.
+ */
+static void
+evldns_udp_write_batch(evldns_server_port *port, evldns_server_request **reqs, unsigned int count)
+{
+	unsigned int	 i, sent = 0;
+	int				 r;
+
+	if (port->sendq_count) {
+		evldns_udp_write_callback(port);
+		if (port->sendq_count) {
+			while (sent < count) {
+				evldns_udp_queue_pending(reqs[sent++]);
+			}
+			return;
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		evldns_srcaddr src;
+
+		server_request_srcaddr(reqs[i], &src);
+		server_send_msghdr(&port->batch_msgs[i].msg_hdr, &port->batch_iov[i],
+			&port->batch_cmsg[i], reqs[i]->wire_response, reqs[i]->wire_resplen,
+			&reqs[i]->addr, reqs[i]->addrlen, &src);
+	}
+
+	while (sent < count) {
+		r = sendmmsg(port->socket, &port->batch_msgs[sent], count - sent, 0);
+		if (r < 0) {
+			if (errno == EAGAIN) {
+				break;
+			}
+
+			/* drop the datagram that failed and carry on */
+			perror("sendmmsg");
+			server_request_free(reqs[sent++]);
+			continue;
+		}
+
+		for (i = 0; i < (unsigned int)r; ++i) {
+			server_request_free(reqs[sent++]);
+		}
+	}
+
+	/* queue anything that couldn't be sent */
+	while (sent < count) {
+		evldns_udp_queue_pending(reqs[sent++]);
+	}
+}
+
+/*
+ * drains the send queue a batch at a time
+ */
+static void
+evldns_udp_flush_batch(evldns_server_port *port)
+{
+	unsigned int	 i, n;
+	int				 r;
+
+	while (port->sendq_count) {
+		n = port->sendq_count;
+		if (n > port->batch_max) {
+			n = port->batch_max;
+		}
+
+		for (i = 0; i < n; ++i) {
+			evldns_pending *p = &port->sendq[(port->sendq_head + i) % port->sendq_cap];
+			server_send_msghdr(&port->batch_msgs[i].msg_hdr, &port->batch_iov[i],
+				&port->batch_cmsg[i], p->wire, p->len, &p->addr, p->addrlen, &p->src);
+		}
+
+		r = sendmmsg(port->socket, port->batch_msgs, n, 0);
+		if (r < 0) {
+			if (errno == EAGAIN) {
+				return;
+			}
+
+			/* drop the datagram that failed and carry on */
+			perror("sendmmsg");
+			r = 1;
+		}
+
+		for (i = 0; i < (unsigned int)r; ++i) {
+			evldns_udp_sendq_pop(port);
+		}
+	}
+}
+
+/*
+ * reads up to port->batch_size datagrams with a single system call,
+ * processes all of them, and then sends all of the answers together
+ */
+static void
+evldns_udp_read_batch(evldns_server_port *port)
+{
+	evldns_server_request	**reqs = port->batch_reqs;
+	unsigned int			 i, n, nresp, size;
+	unsigned int			 budget = port_budget(port), count = 0;
+	int						 r;
+
+	while (!port->sendq_stopped) {
+		size = port->batch_size;
+
+		/* leave the rest for the next loop so other events get a turn */
+		if (budget) {
+			if (count >= budget) {
+				port->budget_exhausted++;
+				return;
+			}
+			if (size > budget - count) {
+				size = budget - count;
+			}
+		}
+
+		/* make sure there's a request object for each slot */
+		for (i = 0; i < size; ++i) {
+			evldns_server_request *req = reqs[i];
+			struct msghdr *msg = &port->batch_msgs[i].msg_hdr;
+
+			if (!req) {
+				if (!(req = server_request_alloc(port))) {
+					break;
+				}
+				reqs[i] = req;
+			}
+
+			port->batch_iov[i].iov_base = req->wire_request;
+			port->batch_iov[i].iov_len = port->pool_bufsize;
+
+			memset(msg, 0, sizeof(*msg));
+			msg->msg_name = &req->addr;
+			msg->msg_namelen = sizeof(struct sockaddr_storage);
+			msg->msg_iov = &port->batch_iov[i];
+			msg->msg_iovlen = 1;
+			msg->msg_control = port->batch_cmsg[i].buf;
+			msg->msg_controllen = sizeof(union evldns_cmsgbuf);
+		}
+		size = i;
+		if (size == 0) {
+			return;
+		}
+
+		r = recvmmsg(port->socket, port->batch_msgs, size, MSG_DONTWAIT, NULL);
+		if (r < 0) {
+			if (errno != EAGAIN) {
+				perror("recvmmsg");
+			}
+			break;
+		}
+		n = r;
+		count += n;
+		port->rx_packets += n;
+
+		/* process everything that arrived */
+		for (i = 0, nresp = 0; i < n; ++i) {
+			evldns_server_request *req = reqs[i];
+			reqs[i] = NULL;
+
+			req->addrlen = port->batch_msgs[i].msg_hdr.msg_namelen;
+			req->wire_reqlen = (uint16_t)port->batch_msgs[i].msg_len;
+			server_port_msghdr(port, req, &port->batch_msgs[i].msg_hdr);
+
+			if (port->batch_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				server_request_put(req);
+			} else if (port->server->pipeline) {
+				port->batch_resp[nresp++] = req;
+			} else if (server_process_packet(req) >= 0) {
+				port->batch_resp[nresp++] = req;
+			} else {
+				server_request_free(req);
+			}
+		}
+
+		/* in pipelined mode they're processed one stage at a time */
+		if (port->server->pipeline && nresp) {
+			unsigned int nwork = nresp;
+
+			server_process_batch(port->batch_resp, port->batch_result, nwork);
+			for (i = 0, nresp = 0; i < nwork; ++i) {
+				if (port->batch_result[i] >= 0) {
+					port->batch_resp[nresp++] = port->batch_resp[i];
+				} else {
+					server_request_free(port->batch_resp[i]);
+				}
+			}
+		}
+
+		/* unused request objects move to the front for next time */
+		for (i = n; i < size; ++i) {
+			reqs[i - n] = reqs[i];
+			reqs[i] = NULL;
+		}
+
+		evldns_udp_write_batch(port, port->batch_resp, nresp);
+
+		/*
+		 * in adaptive mode grow the batch while the socket keeps
+		 * filling it, and shrink it again when the load drops
+		 */
+		if (port->batch_adaptive) {
+			if (n == size && size < port->batch_max) {
+				port->batch_size = size * 2;
+				if (port->batch_size > port->batch_max) {
+					port->batch_size = port->batch_max;
+				}
+			} else if (n < size / 4) {
+				port->batch_size = size / 2;
+			}
+		}
+
+		/* a short batch means the socket has been drained */
+		if (n < size) {
+			break;
+		}
+	}
+}
+
+#endif /* HAVE_RECVMMSG && HAVE_SENDMMSG */
+
+/*-------------------------------------------------------------------*/
+
+static uint64_t
+poll_clock_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * runs the server's event loop in busy-polling mode: instead of
+ * sleeping until libevent reports a readable socket, the UDP ports
+ * are read continuously, and libevent is only polled (without
+ * blocking) for TCP and timer events.  After 'idle_usec' without any
+ * datagrams (EVLDNS_POLL_IDLE_USEC if it's 0) the loop blocks in
+ * libevent until the next event, and then resumes spinning.  Returns
+ * when evldns_server_poll_break() is called.
+ */
+int
+evldns_server_poll(evldns_server *server, unsigned int idle_usec)
+{
+	evldns_server_port *port;
+	uint64_t last_work = poll_clock_usec();
+
+	if (idle_usec == 0) {
+		idle_usec = EVLDNS_POLL_IDLE_USEC;
+	}
+
+	server->poll_stop = 0;
+	while (!server->poll_stop) {
+		uint64_t before = 0, after = 0;
+
+		TAILQ_FOREACH(port, &server->ports, next) {
+			if (port->is_tcp || port->closing || !port->event) {
+				continue;
+			}
+			before += port->rx_packets;
+			evldns_udp_read_callback(port);
+			after += port->rx_packets;
+		}
+
+		if (event_base_loop(server->base, EVLOOP_NONBLOCK) < 0) {
+			return -1;
+		}
+
+		if (after != before) {
+			server->poll_busy++;
+			last_work = poll_clock_usec();
+		} else {
+			server->poll_spins++;
+			if (poll_clock_usec() - last_work >= idle_usec) {
+				server->poll_sleeps++;
+				if (event_base_loop(server->base, EVLOOP_ONCE) < 0) {
+					return -1;
+				}
+				last_work = poll_clock_usec();
+			}
+		}
+	}
+
+	return 0;
+}
+
+void
+evldns_server_poll_break(evldns_server *server)
+{
+	server->poll_stop = 1;
+	event_base_loopbreak(server->base);
+}
+
+void
+evldns_get_poll_stats(evldns_server *server, struct evldns_poll_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->spins = server->poll_spins;
+	stats->busy = server->poll_busy;
+	stats->sleeps = server->poll_sleeps;
+}
+
+/*-------------------------------------------------------------------*/
+
+ldns_pkt *
 evldns_response(const ldns_pkt *req, ldns_pkt_rcode rcode)
 {
-	ldns_pkt *p = ldns_pkt_new();
-	ldns_rr_list *q = ldns_rr_list_clone(ldns_pkt_question(req));
-	ldns_pkt_opcode opcode = ldns_pkt_get_opcode(req);
+	ldns_pkt *p = ldns_pkt_new();
+	ldns_rr_list *q = ldns_rr_list_clone(ldns_pkt_question(req));
+	ldns_pkt_opcode opcode = ldns_pkt_get_opcode(req);
+
+	ldns_pkt_set_id(p, ldns_pkt_id(req));		/* copy ID field */
+
+	if (opcode == LDNS_PACKET_QUERY) {
+		ldns_pkt_set_cd(p, ldns_pkt_cd(req));	/* copy CD bit */
+		ldns_pkt_set_rd(p, ldns_pkt_rd(req));	/* copy RD bit */
+	}
+
+	ldns_pkt_set_qr(p, 1);						/* this is a response */
+	ldns_pkt_set_opcode(p, opcode);				/* copy opcode */
+	ldns_pkt_set_rcode(p, rcode);				/* set rcode */
+
+	ldns_rr_list_deep_free(p->_question);
+	ldns_pkt_set_question(p, q);
+	ldns_pkt_set_qdcount(p, ldns_rr_list_rr_count(q));
+
+	if (ldns_pkt_edns(req)) {
+		ldns_pkt_set_edns_udp_size(p, EVLDNS_UDP_MAX_DEFAULT);
+		if (ldns_pkt_edns_do(req)) {
+			ldns_pkt_set_edns_do(p, 1);
+		}
+	}
+
+	return p;
+}
+
+/*-------------------------------------------------------------------*/
+
+/*
+ * skips over a (possibly compressed) domain name, returning the offset
+ * just past it, or 0 if it runs off the end of the packet
+ */
+static size_t
+wire_skip_name(const uint8_t *wire, size_t len, size_t off)
+{
+	while (off < len) {
+		uint8_t c = wire[off];
+		if (c == 0) {
+			return off + 1;
+		} else if ((c & 0xc0) == 0xc0) {
+			return (off + 2 <= len) ? off + 2 : 0;
+		} else if (c & 0xc0) {
+			return 0;
+		}
+		off += c + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * checks a request's header and extracts the first question and any
+ * EDNS details into 'info' without allocating anything.  Returns -1 if
+ * the packet is malformed.
+ */
+int
+evldns_parse_query(const uint8_t *wire, size_t len, struct evldns_query_info *info)
+{
+	size_t off, start;
+	unsigned int i, nrr;
+
+	memset(info, 0, sizeof(*info));
+	if (len < LDNS_HEADER_SIZE) {
+		return -1;
+	}
+
+	info->id = ldns_read_uint16(wire);
+	info->flags = ldns_read_uint16(wire + 2);
+	info->qdcount = ldns_read_uint16(wire + 4);
+	info->ancount = ldns_read_uint16(wire + 6);
+	info->nscount = ldns_read_uint16(wire + 8);
+	info->arcount = ldns_read_uint16(wire + 10);
+	off = LDNS_HEADER_SIZE;
+
+	/* the first question's name can't be compressed */
+	if (info->qdcount) {
+		start = off;
+		for (;;) {
+			if (off >= len || wire[off] > LDNS_MAX_LABELLEN) {
+				return -1;
+			}
+			uint8_t c = wire[off];
+			off += c + 1;
+			if (off - start > LDNS_MAX_DOMAINLEN) {
+				return -1;
+			}
+			if (c == 0) {
+				break;
+			}
+		}
+		if (off + 4 > len) {
+			return -1;
+		}
+		info->qname_offset = start;
+		info->qname_len = off - start;
+		info->qtype = ldns_read_uint16(wire + off);
+		info->qclass = ldns_read_uint16(wire + off + 2);
+		off += 4;
+
+		/* any others are skipped */
+		for (i = 1; i < info->qdcount; ++i) {
+			if (!(off = wire_skip_name(wire, len, off)) || off + 4 > len) {
+				return -1;
+			}
+			off += 4;
+		}
+	}
+	info->question_end = off;
+
+	/* look for an OPT record in the additional section */
+	nrr = info->ancount + info->nscount + info->arcount;
+	for (i = 0; i < nrr; ++i) {
+		start = off;
+		if (!(off = wire_skip_name(wire, len, off)) || off + 10 > len) {
+			return -1;
+		}
+
+		if (i >= info->ancount + info->nscount &&
+			ldns_read_uint16(wire + off) == LDNS_RR_TYPE_OPT)
+		{
+			/* there can only be one, and it belongs to the root */
+			if (info->edns || wire[start] != 0) {
+				return -1;
+			}
+			info->edns = 1;
+			info->edns_size = ldns_read_uint16(wire + off + 2);
+			info->edns_version = wire[off + 5];
+			info->edns_do = (wire[off + 6] & 0x80) != 0;
+		}
+
+		off += 10 + ldns_read_uint16(wire + off + 8);
+		if (off > len) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * writes a response with no records other than the question (if there
+ * was exactly one) and an OPT record (if the request had one) directly
+ * in wire format.  Returns -1 if out of memory.
+ */
+static int
+server_error_response(evldns_server_request *req, ldns_pkt_rcode rcode)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+	size_t qlen = (qi->qdcount == 1) ? qi->qname_len + 4 : 0;
+	size_t len = LDNS_HEADER_SIZE + qlen + (qi->edns ? 11 : 0);
+	struct evldns_builder b;
+	uint8_t *p;
+
+	if (!(p = evldns_request_alloc(req, len))) {
+		return -1;
+	}
+
+	(void)evldns_builder_init(&b, p, len, req, rcode);
+
+	req->wire_response = p;
+	req->wire_resplen = evldns_builder_finish(&b);
+	req->wire_arena = 1;
+
+	return 0;
+}
+
+/*-------------------------------------------------------------------*/
+
+/*
+ * picks out the ancillary data evldns asks for on UDP sockets
+ */
+static void
+server_port_cmsg(evldns_server_port *port, evldns_server_request *req, struct cmsghdr *cmsg)
+{
+	/* the address the query was sent to, for sockets bound to a wildcard */
+#ifdef IP_PKTINFO
+	if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+		struct sockaddr_in *local = (struct sockaddr_in *)&req->local_addr;
+		struct in_pktinfo info;
+		memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+		memset(local, 0, sizeof(*local));
+		local->sin_family = AF_INET;
+		local->sin_addr = info.ipi_addr;
+		local->sin_port = ((struct sockaddr_in *)&port->sockname)->sin_port;
+		req->local_addrlen = sizeof(*local);
+		req->local_ifindex = info.ipi_ifindex;
+	}
+#endif
+#ifdef IPV6_PKTINFO
+	if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+		struct sockaddr_in6 *local = (struct sockaddr_in6 *)&req->local_addr;
+		struct in6_pktinfo info;
+		memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+		memset(local, 0, sizeof(*local));
+		local->sin6_family = AF_INET6;
+		local->sin6_addr = info.ipi6_addr;
+		local->sin6_port = ((struct sockaddr_in6 *)&port->sockname)->sin6_port;
+		if (IN6_IS_ADDR_LINKLOCAL(&info.ipi6_addr)) {
+			local->sin6_scope_id = info.ipi6_ifindex;
+		}
+		req->local_addrlen = sizeof(*local);
+		req->local_ifindex = info.ipi6_ifindex;
+	}
+#endif
+
+#ifdef SO_RXQ_OVFL
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+		uint32_t drops;
+		memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+		port->kernel_drops = drops;
+	}
+#endif
+}
+
+static void
+server_port_msghdr(evldns_server_port *port, evldns_server_request *req, struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		server_port_cmsg(port, req, cmsg);
+	}
+}
+
+/*
+ * the local address that a UDP response should come from - only known
+ * for sockets with EVLDNS_SOCK_PKTINFO
+ */
+static void
+server_request_srcaddr(evldns_server_request *req, evldns_srcaddr *src)
+{
+	memset(src, 0, sizeof(*src));
+	if (!req->local_addrlen) {
+		src->family = AF_UNSPEC;
+	} else if (req->local_addr.ss_family == AF_INET) {
+		src->family = AF_INET;
+		src->a.v4 = ((struct sockaddr_in *)&req->local_addr)->sin_addr;
+	} else if (req->local_addr.ss_family == AF_INET6) {
+		src->family = AF_INET6;
+		src->a.v6 = ((struct sockaddr_in6 *)&req->local_addr)->sin6_addr;
+		if (IN6_IS_ADDR_LINKLOCAL(&src->a.v6)) {
+			src->ifindex = req->local_ifindex;
+		}
+	}
+}
+
+/*
+ * sets up a msghdr to send a datagram, adding a PKTINFO control
+ * message to choose the source address if it's known
+ */
+static void
+server_send_msghdr(struct msghdr *msg, struct iovec *iov, union evldns_cmsgbuf *cbuf,
+	uint8_t *wire, size_t len, struct sockaddr_storage *addr, socklen_t addrlen,
+	const evldns_srcaddr *src)
+{
+	struct cmsghdr *cmsg = &cbuf->hdr;
+
+	memset(msg, 0, sizeof(*msg));
+	iov->iov_base = wire;
+	iov->iov_len = len;
+	msg->msg_name = addr;
+	msg->msg_namelen = addrlen;
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+
+#ifdef IP_PKTINFO
+	if (src->family == AF_INET) {
+		struct in_pktinfo info;
+		memset(&info, 0, sizeof(info));
+		info.ipi_spec_dst = src->a.v4;
+		memset(cbuf, 0, CMSG_SPACE(sizeof(info)));
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+		memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+		msg->msg_control = cbuf->buf;
+		msg->msg_controllen = CMSG_SPACE(sizeof(info));
+	}
+#endif
+#ifdef IPV6_PKTINFO
+	if (src->family == AF_INET6) {
+		struct in6_pktinfo info;
+		memset(&info, 0, sizeof(info));
+		info.ipi6_addr = src->a.v6;
+		info.ipi6_ifindex = src->ifindex;
+		memset(cbuf, 0, CMSG_SPACE(sizeof(info)));
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+		memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+		msg->msg_control = cbuf->buf;
+		msg->msg_controllen = CMSG_SPACE(sizeof(info));
+	}
+#endif
+}
+
+static void
+server_port_free(evldns_server_port *port)
+{
+	evldns_server_request *req;
+
+	TAILQ_REMOVE(&port->server->ports, port, next);
+
+	if (port->event) {
+		event_free(port->event);
+	}
+
+	while (port->sendq_count) {
+		evldns_udp_sendq_pop(port);
+	}
+	free(port->sendq);
+
+	while ((req = TAILQ_FIRST(&port->free_reqs)) != NULL) {
+		TAILQ_REMOVE(&port->free_reqs, req, next);
+		arena_free(req->arena);
+		free(req->wire_request);
+		free(req);
+	}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	/* spare request objects left over from the last batch */
+	if (port->batch_reqs) {
+		unsigned int i;
+		for (i = 0; i < EVLDNS_MAX_BATCH && port->batch_reqs[i]; ++i) {
+			arena_free(port->batch_reqs[i]->arena);
+			free(port->batch_reqs[i]->wire_request);
+			free(port->batch_reqs[i]);
+		}
+	}
+	free(port->batch_msgs);
+	free(port->batch_iov);
+	free(port->batch_reqs);
+	free(port->batch_resp);
+	free(port->batch_result);
+	free(port->batch_cmsg);
+#endif
+	free(port);
+}
+
+/*
+ * Each request has an arena for memory that only lives as long as the
+ * request does.  Allocations are carved off the newest chunk, and the
+ * whole arena is released at once when the request is finished with.
+ * If a request needed more than one chunk they're replaced by a single
+ * chunk big enough for all of them, so that a recycled request can
+ * serve the same query again without calling malloc() at all.  No
+ * more than EVLDNS_ARENA_MAX is kept between requests, so a one-off
+ * large message doesn't pin its buffer to a long-lived TCP connection.
+ */
+struct evldns_arena_chunk {
+	struct evldns_arena_chunk	*next;
+	size_t						 size;
+	size_t						 used;
+};
+
+#define ARENA_ALIGN		16
+#define ARENA_ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER	ARENA_ROUND(sizeof(struct evldns_arena_chunk))
+
+static struct evldns_arena_chunk *
+arena_chunk_new(size_t size)
+{
+	struct evldns_arena_chunk *chunk;
+
+	if (!(chunk = malloc(size))) {
+		perror("malloc");
+		return NULL;
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = ARENA_HEADER;
+
+	return chunk;
+}
+
+static void
+arena_free(struct evldns_arena_chunk *chunk)
+{
+	while (chunk) {
+		struct evldns_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+static void
+arena_reset(evldns_server_request *req)
+{
+	struct evldns_arena_chunk *chunk = req->arena;
+	size_t total = 0;
+
+	req->wire_out = NULL;
+
+	if (!chunk) {
+		return;
+	}
+
+	if (!chunk->next) {
+		if (chunk->size > EVLDNS_ARENA_MAX) {
+			arena_free(chunk);
+			req->arena = NULL;
+		} else {
+			chunk->used = ARENA_HEADER;
+		}
+		return;
+	}
+
+	for (; chunk; chunk = chunk->next) {
+		total += chunk->size;
+	}
+	arena_free(req->arena);
+	req->arena = (total <= EVLDNS_ARENA_MAX) ? arena_chunk_new(total) : NULL;
+}
+
+/*
+ * allocates memory that is released when the request is freed (or,
+ * for TCP, when its response has been sent).  The memory is suitably
+ * aligned for any type but isn't zeroed.  A 'wire_response' allocated
+ * here must be flagged with 'wire_arena' so that it isn't free()d.
+ */
+void *
+evldns_request_alloc(evldns_server_request *req, size_t size)
+{
+	struct evldns_arena_chunk *chunk = req->arena;
+	void *p;
+
+	size = ARENA_ROUND(size);
+	if (!chunk || chunk->used + size > chunk->size) {
+		size_t want = (chunk && chunk->size > EVLDNS_ARENA_SIZE) ?
+			chunk->size : EVLDNS_ARENA_SIZE;
+		while (want < ARENA_HEADER + size) {
+			want *= 2;
+		}
+		if (!(chunk = arena_chunk_new(want))) {
+			return NULL;
+		}
+		chunk->next = req->arena;
+		req->arena = chunk;
+	}
+
+	p = (uint8_t *)chunk + chunk->used;
+	chunk->used += size;
+
+	return p;
+}
+
+/*
+ * returns a UDP request object, from the port's free list if possible
+ */
+static evldns_server_request *
+server_request_alloc(evldns_server_port *port)
+{
+	evldns_server_request *req = TAILQ_FIRST(&port->free_reqs);
+
+	if (req) {
+		TAILQ_REMOVE(&port->free_reqs, req, next);
+		port->pool_free--;
+		port->pool_reuses++;
+	} else {
+		if (!(req = calloc(1, sizeof(*req)))) {
+			perror("calloc");
+			return NULL;
+		}
+		if (!(req->wire_request = malloc(port->pool_bufsize))) {
+			perror("malloc");
+			free(req);
+			return NULL;
+		}
+		req->pooled = 1;
+		port->pool_allocs++;
+	}
+
+	req->port = port;
+	req->socket = port->socket;
+	req->local_addrlen = 0;
+
+	if (++port->pool_in_use > port->pool_high_water) {
+		port->pool_high_water = port->pool_in_use;
+	}
+
+	return req;
+}
+
+/*
+ * disposes of a request object without touching the port reference
+ * count, e.g. for UDP requests that were never processed
+ */
+static void
+server_request_put(evldns_server_request *req)
+{
+	evldns_server_port *port = req->port;
+
+	ldns_pkt_free(req->request);
+	ldns_pkt_free(req->response);
+	if (!req->wire_arena) {
+		free(req->wire_response);
+	}
+
+	/*
+	 * UDP request objects go back on the free list, keeping their
+	 * receive buffer and arena, unless the pool is already full
+	 */
+	if (req->pooled) {
+		port->pool_in_use--;
+		if (port->pool_free < port->pool_size) {
+			uint8_t *buffer = req->wire_request;
+			struct evldns_arena_chunk *arena;
+
+			arena_reset(req);
+			arena = req->arena;
+			memset(req, 0, sizeof(*req));
+			req->wire_request = buffer;
+			req->arena = arena;
+			req->pooled = 1;
+			TAILQ_INSERT_HEAD(&port->free_reqs, req, next);
+			port->pool_free++;
+			return;
+		}
+	}
+
+	arena_free(req->arena);
+	free(req->wire_request);
+	free(req->event);
+	free(req);
+}
+
+static int
+server_request_free(evldns_server_request *req)
+{
+	req->port->refcnt--;
+	server_request_put(req);
+
+	// TODO?: perhaps free port structure on refcnt == 0?
+
+	return 0;
+}
+
+/*-------------------------------------------------------------------*/
+
+/*
+ * The callback table is indexed when entries are registered so that
+ * dispatch doesn't have to try every entry:
+ *
+ *  - entries for an exact name are hashed on (name, class, type)
+ *  - "*.<name>" entries hang off <name>'s node in a trie of reversed
+ *    labels, so that walking down the trie from the root along the
+ *    QNAME visits every wildcard that can match it
+ *  - entries without a name are kept in a list of their own
+ *
+ * Every entry has a sequence number, and the matching entries from
+ * each list are merged back into registration order for dispatch.
+ */
+
+#define FNV_OFFSET		2166136261U
+#define FNV_PRIME		16777619U
+
+static uint32_t
+index_hash(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+/* combines a name's evldns_dname_canonical_hash() with the class and type */
+static uint32_t
+index_key_hash(uint32_t name_hash, ldns_rr_class rr_class, ldns_rr_type rr_type)
+{
+	uint16_t ct[2] = { (uint16_t)rr_class, (uint16_t)rr_type };
+
+	return index_hash(name_hash ^ FNV_OFFSET, ct, sizeof(ct));
+}
+
+static uint32_t
+index_node_hash(const struct evldns_cbnode *parent, const uint8_t *label)
+{
+	return index_hash(index_hash(FNV_OFFSET, &parent, sizeof(parent)),
+		label, label[0] + 1);
+}
+
+static struct evldns_hnode *
+htable_chain(struct evldns_htable *t, uint32_t hash)
+{
+	return t->size ? t->buckets[hash & (t->size - 1)] : NULL;
+}
+
+static int
+htable_insert(struct evldns_htable *t, struct evldns_hnode *node)
+{
+	/* keep the load factor at or below one */
+	if (t->count >= t->size) {
+		unsigned int i, size = t->size ? t->size * 2 : 64;
+		struct evldns_hnode **buckets = calloc(size, sizeof(*buckets));
+		if (!buckets) {
+			perror("calloc");
+			return -1;
+		}
+		for (i = 0; i < t->size; ++i) {
+			struct evldns_hnode *n, *next;
+			for (n = t->buckets[i]; n; n = next) {
+				next = n->hnext;
+				n->hnext = buckets[n->hash & (size - 1)];
+				buckets[n->hash & (size - 1)] = n;
+			}
+		}
+		free(t->buckets);
+		t->buckets = buckets;
+		t->size = size;
+	}
+
+	node->hnext = t->buckets[node->hash & (t->size - 1)];
+	t->buckets[node->hash & (t->size - 1)] = node;
+	t->count++;
+
+	return 0;
+}
+
+static void
+cblist_append(struct evldns_cblist *list, evldns_cb *cb)
+{
+	if (list->last) {
+		list->last->inext = cb;
+	} else {
+		list->first = cb;
+	}
+	list->last = cb;
+}
+
+static struct evldns_cbkey *
+index_find_key(evldns_server *root, const uint8_t *name, size_t len, uint32_t name_hash, ldns_rr_class rr_class, ldns_rr_type rr_type)
+{
+	uint32_t hash = index_key_hash(name_hash, rr_class, rr_type);
+	struct evldns_hnode *n;
+
+	for (n = htable_chain(&root->cb_exact, hash); n; n = n->hnext) {
+		struct evldns_cbkey *key = (struct evldns_cbkey *)n;
+		if (n->hash == hash && key->rr_class == rr_class &&
+			key->rr_type == rr_type && key->name_len == len &&
+			memcmp(key->name, name, len) == 0)
+		{
+			return key;
+		}
+	}
+
+	return NULL;
+}
+
+static struct evldns_cbnode *
+index_find_node(evldns_server *root, const struct evldns_cbnode *parent, const uint8_t *label)
+{
+	uint32_t hash = index_node_hash(parent, label);
+	struct evldns_hnode *n;
+
+	for (n = htable_chain(&root->cb_trie, hash); n; n = n->hnext) {
+		struct evldns_cbnode *node = (struct evldns_cbnode *)n;
+		if (n->hash == hash && node->parent == parent &&
+			memcmp(node->label, label, label[0] + 1) == 0)
+		{
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * finds the offsets of the labels of a wire format name, returning
+ * how many there are (not counting the root)
+ */
+static int
+index_labels(const uint8_t *name, uint8_t *offsets)
+{
+	int n = 0;
+	size_t off = 0;
+
+	while (name[off]) {
+		offsets[n++] = off;
+		off += name[off] + 1;
+	}
+
+	return n;
+}
+
+/*
+ * adds a new callback entry to the index of 'root', which must be the
+ * owner of the callback table
+ */
+static int
+server_index_cb(evldns_server *root, evldns_cb *cb)
+{
+	cb->seq = root->cb_seq++;
+
+	if (!cb->rdf) {
+		cblist_append(&root->cb_all, cb);
+		return 0;
+	}
+
+	const uint8_t *name = ldns_rdf_data(cb->rdf);
+	size_t len = ldns_rdf_size(cb->rdf);
+
+	/* wildcards go on their parent's trie node, creating it if need be */
+	if (name[0] == 1 && name[1] == '*') {
+		struct evldns_cbnode *node = &root->cb_wild_root;
+		uint8_t offsets[LDNS_MAX_DOMAINLEN / 2 + 1];
+		int i = index_labels(name + 2, offsets);
+
+		while (i-- > 0) {
+			const uint8_t *label = name + 2 + offsets[i];
+			struct evldns_cbnode *child = index_find_node(root, node, label);
+			if (!child) {
+				if (!(child = calloc(1, sizeof(*child)))) {
+					perror("calloc");
+					return -1;
+				}
+				child->parent = node;
+				memcpy(child->label, label, label[0] + 1);
+				child->h.hash = index_node_hash(node, label);
+				if (htable_insert(&root->cb_trie, &child->h) < 0) {
+					free(child);
+					return -1;
+				}
+			}
+			node = child;
+		}
+		cblist_append(&node->list, cb);
+		return 0;
+	}
+
+	/* everything else is an exact match */
+	uint8_t scratch[LDNS_MAX_DOMAINLEN + 1];
+	uint32_t name_hash = evldns_dname_canonical_hash(scratch, name, len);
+	struct evldns_cbkey *key = index_find_key(root, name, len, name_hash,
+		cb->rr_class, cb->rr_type);
+	if (!key) {
+		if (!(key = calloc(1, sizeof(*key)))) {
+			perror("calloc");
+			return -1;
+		}
+		key->name = name;
+		key->name_len = len;
+		key->rr_class = cb->rr_class;
+		key->rr_type = cb->rr_type;
+		key->h.hash = index_key_hash(name_hash, cb->rr_class, cb->rr_type);
+		if (htable_insert(&root->cb_exact, &key->h) < 0) {
+			free(key);
+			return -1;
+		}
+	}
+	cblist_append(&key->list, cb);
+
+	return 0;
+}
+
+/* the first entry from 'cb' onwards that accepts the given class and type */
+static evldns_cb *
+index_next(evldns_cb *cb, ldns_rr_class qclass, ldns_rr_type qtype)
+{
+	while (cb) {
+		if ((cb->rr_class == LDNS_RR_CLASS_ANY || cb->rr_class == qclass) &&
+			(cb->rr_type == LDNS_RR_TYPE_ANY || cb->rr_type == qtype))
+		{
+			break;
+		}
+		cb = cb->inext;
+	}
+
+	return cb;
+}
+
+/* enough for four exact lists, the whole trie path and the unnamed list */
+#define INDEX_CURSORS	(4 + LDNS_MAX_DOMAINLEN / 2 + 2 + 1)
+
+/*
+ * collects the heads of every index list with entries matching the
+ * canonical QNAME, class and type into 'cursors'
+ */
+static int
+index_lookup(evldns_server *root, const uint8_t *qname, size_t qname_len, uint32_t qname_hash, ldns_rr_class qclass, ldns_rr_type qtype, evldns_cb **cursors)
+{
+	ldns_rr_class classes[2] = { qclass, LDNS_RR_CLASS_ANY };
+	ldns_rr_type types[2] = { qtype, LDNS_RR_TYPE_ANY };
+	struct evldns_cbnode *node = &root->cb_wild_root;
+	uint8_t offsets[LDNS_MAX_DOMAINLEN / 2 + 1];
+	int i, j, n, depth, count = 0;
+	evldns_cb *cb;
+
+	/* exact entries, for the specific and ANY class and type */
+	if (root->cb_exact.count) {
+		for (i = 0; i < (qclass == LDNS_RR_CLASS_ANY ? 1 : 2); ++i) {
+			for (j = 0; j < (qtype == LDNS_RR_TYPE_ANY ? 1 : 2); ++j) {
+				struct evldns_cbkey *key = index_find_key(root, qname,
+					qname_len, qname_hash, classes[i], types[j]);
+				if (key) {
+					cursors[count++] = key->list.first;
+				}
+			}
+		}
+	}
+
+	/* wildcards on every strict ancestor of the QNAME */
+	if (root->cb_trie.count || root->cb_wild_root.list.first) {
+		n = index_labels(qname, offsets);
+		for (depth = 0; node && depth < n; ++depth) {
+			if ((cb = index_next(node->list.first, qclass, qtype))) {
+				cursors[count++] = cb;
+			}
+			node = index_find_node(root, node, qname + offsets[n - depth - 1]);
+		}
+	}
+
+	/* and the entries that match everything */
+	if ((cb = index_next(root->cb_all.first, qclass, qtype))) {
+		cursors[count++] = cb;
+	}
+
+	return count;
+}
+
+/*-------------------------------------------------------------------*/
+
+/*
+ * The optional dispatch memo remembers, per server, which entry
+ * answered each recent (QNAME, QTYPE, QCLASS) so that repeated
+ * questions can skip the index lookup.  Questions that nothing
+ * answered aren't remembered, as a callback declining one query says
+ * nothing about the next.  It's a direct-mapped table so
+ * it never grows, and entries are tagged with the callback table's
+ * sequence number so that registering a callback invalidates them all.
+ */
+struct evldns_memo {
+	unsigned int					 generation;	/* root->cb_seq + 1, 0 if unused */
+	uint16_t						 qtype;
+	uint16_t						 qclass;
+	uint16_t						 qname_len;
+	uint8_t							 qname[LDNS_MAX_DOMAINLEN + 1];
+	struct evldns_cb				*cb;
+};
+
+int
+evldns_set_dispatch_cache(evldns_server *server, unsigned int size)
+{
+	struct evldns_memo *memo = NULL;
+	unsigned int n = 1;
+
+	if (size) {
+		while (n < size) {
+			n <<= 1;
+		}
+		if (!(memo = calloc(n, sizeof(*memo)))) {
+			perror("calloc");
+			return -1;
+		}
+	} else {
+		n = 0;
+	}
+
+	free(server->memo);
+	server->memo = memo;
+	server->memo_size = n;
+
+	return 0;
+}
+
+void
+evldns_get_dispatch_stats(evldns_server *server, struct evldns_dispatch_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->size = server->memo_size;
+	stats->hits = server->memo_hits;
+	stats->misses = server->memo_misses;
+}
+
+static struct evldns_memo *
+memo_slot(evldns_server *server, const evldns_server_request *req, uint32_t qname_hash)
+{
+	uint32_t h = index_key_hash(qname_hash, req->qinfo.qclass, req->qinfo.qtype);
+
+	return &server->memo[h & (server->memo_size - 1)];
+}
+
+static int
+memo_match(const struct evldns_memo *memo, const evldns_server_request *req)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+
+	return memo->qtype == qi->qtype && memo->qclass == qi->qclass &&
+		memo->qname_len == qi->qname_len &&
+		memcmp(memo->qname, req->qname, qi->qname_len) == 0;
+}
+
+static void
+memo_store(struct evldns_memo *memo, const evldns_server_request *req, evldns_cb *cb, unsigned int seq)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+
+	memo->generation = seq + 1;
+	memo->qtype = qi->qtype;
+	memo->qclass = qi->qclass;
+	memo->qname_len = qi->qname_len;
+	memcpy(memo->qname, req->qname, qi->qname_len);
+	memo->cb = cb;
+}
+
+/*-------------------------------------------------------------------*/
+
+/*
+ * The optional response cache keeps the final wire format response to
+ * recent questions, per server, so that repeats skip the callbacks and
+ * serialisation altogether.  Besides the question the key includes
+ * everything in the request that evldns copies into its responses -
+ * the OPCODE, RD and CD bits and the EDNS details - and the transport.
+ *
+ * Like the dispatch memo it's direct-mapped and invalidated by changes
+ * to the callback table.  Responses are cached for the TTL given by
+ * their callback with evldns_set_cache_ttl(), or else the default TTL.
+ * Callbacks whose answers depend on anything else about the request,
+ * such as the client's address, must mark them uncacheable.
+ */
+#define RCACHE_FLAGS_MASK	((uint16_t)(((LDNS_OPCODE_MASK | LDNS_RD_MASK) << 8) | LDNS_CD_MASK))
+
+struct evldns_rcache {
+	unsigned int					 generation;	/* root->cb_seq + 1, 0 if unused */
+	time_t							 expires;
+	uint16_t						 qtype;
+	uint16_t						 qclass;
+	uint16_t						 flags;			/* RCACHE_FLAGS_MASK bits */
+	uint16_t						 edns_size;
+	uint8_t							 edns_version;
+	uint8_t							 edns:1;
+	uint8_t							 edns_do:1;
+	uint8_t							 is_tcp:1;
+	uint16_t						 qname_len;
+	uint8_t							 qname[LDNS_MAX_DOMAINLEN + 1];
+	uint16_t						 len;
+	uint8_t							*wire;
+};
+
+/*
+ * sets up a cache of 'size' responses (rounded up to a power of two),
+ * kept for 'ttl' seconds unless their callbacks say otherwise - a zero
+ * 'ttl' caches only responses whose callbacks set a TTL.  A zero 'size'
+ * disables the cache.
+ */
+int
+evldns_set_response_cache(evldns_server *server, unsigned int size, uint32_t ttl)
+{
+	struct evldns_rcache *rcache = NULL;
+	unsigned int i, n = 1;
+
+	if (size) {
+		while (n < size) {
+			n <<= 1;
+		}
+		if (!(rcache = calloc(n, sizeof(*rcache)))) {
+			perror("calloc");
+			return -1;
+		}
+	} else {
+		n = 0;
+	}
+
+	for (i = 0; i < server->rcache_size; ++i) {
+		free(server->rcache[i].wire);
+	}
+	free(server->rcache);
+	server->rcache = rcache;
+	server->rcache_size = n;
+	server->rcache_ttl = ttl;
+
+	return 0;
+}
+
+void
+evldns_get_cache_stats(evldns_server *server, struct evldns_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->size = server->rcache_size;
+	stats->hits = server->rcache_hits;
+	stats->misses = server->rcache_misses;
+	stats->stores = server->rcache_stores;
+}
+
+/*
+ * sets how long a callback's response may be cached, with 0 meaning
+ * that it mustn't be
+ */
+void
+evldns_set_cache_ttl(evldns_server_request *req, uint32_t ttl)
+{
+	req->cache_ttl = ttl;
+	req->cache_set = 1;
+}
+
+static struct evldns_rcache *
+rcache_bucket(evldns_server *server, uint32_t qname_hash, ldns_rr_class qclass, ldns_rr_type qtype, uint16_t flags, int edns_do, int is_tcp, uint16_t edns_size)
+{
+	uint16_t rest[3] = { flags, edns_size, (uint16_t)(edns_do | (is_tcp << 1)) };
+	uint32_t h = index_hash(index_key_hash(qname_hash, qclass, qtype),
+		rest, sizeof(rest));
+
+	return &server->rcache[h & (server->rcache_size - 1)];
+}
+
+static struct evldns_rcache *
+rcache_slot(evldns_server *server, const evldns_server_request *req, uint32_t qname_hash)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+
+	return rcache_bucket(server, qname_hash, qi->qclass, qi->qtype,
+		ldns_read_uint16(req->wire_request + 2) & RCACHE_FLAGS_MASK,
+		qi->edns_do, req->is_tcp, qi->edns_size);
+}
+
+static int
+rcache_match(const struct evldns_rcache *rc, const evldns_server_request *req)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+
+	return rc->qtype == qi->qtype && rc->qclass == qi->qclass &&
+		rc->flags == (ldns_read_uint16(req->wire_request + 2) & RCACHE_FLAGS_MASK) &&
+		rc->edns == qi->edns && rc->edns_do == qi->edns_do &&
+		rc->edns_size == qi->edns_size && rc->edns_version == qi->edns_version &&
+		rc->is_tcp == req->is_tcp &&
+		rc->qname_len == qi->qname_len &&
+		memcmp(rc->qname, req->qname, qi->qname_len) == 0;
+}
+
+/*
+ * answers the request from a cached response, patching in its ID and
+ * the exact QNAME from the request (to preserve any 0x20 encoding).
+ * Returns -1 if out of memory.
+ */
+static int
+rcache_answer(const struct evldns_rcache *rc, evldns_server_request *req)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+	uint8_t *p;
+
+	if (!(p = evldns_request_alloc(req, rc->len))) {
+		return -1;
+	}
+	memcpy(p, rc->wire, rc->len);
+	ldns_write_uint16(p, qi->id);
+	memcpy(p + LDNS_HEADER_SIZE, req->wire_request + qi->qname_offset, qi->qname_len);
+
+	req->wire_response = p;
+	req->wire_resplen = rc->len;
+	req->wire_arena = 1;
+
+	return 0;
+}
+
+/*
+ * caches the response to a request that missed, if it's cacheable and
+ * its question section is just the request's question
+ */
+static void
+rcache_store(evldns_server *server, evldns_server_request *req)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+	const uint8_t *resp = req->wire_response;
+	uint32_t ttl = req->cache_set ? req->cache_ttl : server->rcache_ttl;
+	struct evldns_rcache *rc;
+	uint8_t *wire;
+
+	if (ttl == 0 || req->wire_resplen > 0xffff ||
+		req->wire_resplen < LDNS_HEADER_SIZE + qi->qname_len + 4 ||
+		ldns_read_uint16(resp + 4) != 1 ||
+		!evldns_dname_equal(resp + LDNS_HEADER_SIZE, qi->qname_len,
+			req->qname, qi->qname_len))
+	{
+		return;
+	}
+
+	if (!(wire = malloc(req->wire_resplen))) {
+		return;
+	}
+	memcpy(wire, resp, req->wire_resplen);
+
+	rc = rcache_slot(server, req, evldns_dname_canonical_hash(req->qname,
+		req->qname, qi->qname_len));
+	free(rc->wire);
+	rc->generation = server->root->cb_seq + 1;
+	rc->expires = time(NULL) + ttl;
+	rc->qtype = qi->qtype;
+	rc->qclass = qi->qclass;
+	rc->flags = ldns_read_uint16(req->wire_request + 2) & RCACHE_FLAGS_MASK;
+	rc->edns = qi->edns;
+	rc->edns_do = qi->edns_do;
+	rc->edns_size = qi->edns_size;
+	rc->edns_version = qi->edns_version;
+	rc->is_tcp = req->is_tcp;
+	rc->qname_len = qi->qname_len;
+	memcpy(rc->qname, req->qname, qi->qname_len);
+	rc->len = (uint16_t)req->wire_resplen;
+	rc->wire = wire;
+
+	server->rcache_stores++;
+}
+
+/*
+ * The response cache can be saved to a snapshot file and loaded back
+ * at startup, so that a restarted server doesn't start cold.  The file
+ * is a header followed by the unexpired entries:
+ *
+ *   struct rcache_file_header
+ *   { struct rcache_file_entry, QNAME, response } ...
+ *
+ * in native byte order.  Expiry times are wall clock times.  The header
+ * carries a fingerprint of the callback table - the name, class, type
+ * and kind of each entry in order - and a snapshot taken with another
+ * table is ignored.  The fingerprint can't see what the callbacks do,
+ * so snapshots should be removed when that changes.
+ */
+#define RCACHE_FILE_MAGIC	"evldns-rcache-1"
+
+struct rcache_file_header {
+	char							 magic[16];
+	uint64_t						 fingerprint;
+	uint32_t						 count;
+	uint32_t						 reserved;
+};
+
+struct rcache_file_entry {
+	int64_t							 expires;
+	uint16_t						 qtype;
+	uint16_t						 qclass;
+	uint16_t						 flags;
+	uint16_t						 edns_size;
+	uint8_t							 edns_version;
+	uint8_t							 bits;			/* edns, edns_do, is_tcp */
+	uint16_t						 qname_len;
+	uint16_t						 len;
+	uint16_t						 reserved;
+};
+
+#define FNV64_OFFSET	14695981039346656037ULL
+#define FNV64_PRIME		1099511628211ULL
+
+static uint64_t
+fingerprint_add(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= FNV64_PRIME;
+	}
+
+	return h;
+}
+
+static uint64_t
+rcache_fingerprint(evldns_server *server)
+{
+	evldns_server *root = server->root;
+	uint64_t h = FNV64_OFFSET;
+	evldns_cb *cb;
+
+	TAILQ_FOREACH(cb, &root->callbacks, next) {
+		uint16_t ct[3] = {
+			(uint16_t)cb->rr_class, (uint16_t)cb->rr_type,
+			(uint16_t)(cb->wire_callback ? 3 : cb->name_callback ? 2 : 1)
+		};
+		uint8_t len = cb->rdf ? (uint8_t)ldns_rdf_size(cb->rdf) : 0;
+
+		h = fingerprint_add(h, &len, 1);
+		if (len) {
+			h = fingerprint_add(h, ldns_rdf_data(cb->rdf), len);
+		}
+		h = fingerprint_add(h, ct, sizeof(ct));
+	}
+
+	/* a compiled matcher is a different table */
+	if (root->matcher) {
+		h = fingerprint_add(h, "matcher", 7);
+	}
+
+	return h;
+}
+
+/*
+ * writes the unexpired entries of the server's response cache to
+ * 'path', via a temporary file so that the snapshot is replaced
+ * atomically.  Returns the number of entries saved, or -1.
+ */
+int
+evldns_save_response_cache(evldns_server *server, const char *path)
+{
+	struct rcache_file_header hdr;
+	unsigned int i, seq = server->root->cb_seq + 1;
+	time_t now = time(NULL);
+	char *tmp;
+	FILE *fp;
+	int ok;
+
+	if (!server->rcache_size) {
+		return -1;
+	}
+
+	if (!(tmp = malloc(strlen(path) + 5))) {
+		perror("malloc");
+		return -1;
+	}
+	sprintf(tmp, "%s.tmp", path);
+
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, RCACHE_FILE_MAGIC);
+	hdr.fingerprint = rcache_fingerprint(server);
+	for (i = 0; i < server->rcache_size; ++i) {
+		const struct evldns_rcache *rc = &server->rcache[i];
+		if (rc->generation == seq && rc->expires > now) {
+			hdr.count++;
+		}
+	}
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+	for (i = 0; ok && i < server->rcache_size; ++i) {
+		const struct evldns_rcache *rc = &server->rcache[i];
+		struct rcache_file_entry ent;
+
+		if (rc->generation != seq || rc->expires <= now) {
+			continue;
+		}
+
+		memset(&ent, 0, sizeof(ent));
+		ent.expires = rc->expires;
+		ent.qtype = rc->qtype;
+		ent.qclass = rc->qclass;
+		ent.flags = rc->flags;
+		ent.edns_size = rc->edns_size;
+		ent.edns_version = rc->edns_version;
+		ent.bits = rc->edns | (rc->edns_do << 1) | (rc->is_tcp << 2);
+		ent.qname_len = rc->qname_len;
+		ent.len = rc->len;
+
+		ok = fwrite(&ent, sizeof(ent), 1, fp) == 1 &&
+			fwrite(rc->qname, rc->qname_len, 1, fp) == 1 &&
+			fwrite(rc->wire, rc->len, 1, fp) == 1;
+	}
+
+	if (fclose(fp) != 0) {
+		ok = 0;
+	}
+	if (!ok || rename(tmp, path) < 0) {
+		perror(path);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+
+	return (int)hdr.count;
+}
+
+/*
+ * maps a snapshot written by evldns_save_response_cache() and copies
+ * its unexpired entries into the server's response cache, which must
+ * already be set up.  Returns the number of entries loaded, 0 if the
+ * snapshot was for a different callback table, or -1.
+ */
+int
+evldns_load_response_cache(evldns_server *server, const char *path)
+{
+	const struct rcache_file_header *hdr;
+	const uint8_t *map, *p, *end;
+	unsigned int seq = server->root->cb_seq + 1;
+	time_t now = time(NULL);
+	struct stat st;
+	uint32_t i;
+	int fd, n = 0;
+
+	if (!server->rcache_size) {
+		return -1;
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		fprintf(stderr, "%s: not a response cache snapshot\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	hdr = (const struct rcache_file_header *)map;
+	if (memcmp(hdr->magic, RCACHE_FILE_MAGIC, sizeof(RCACHE_FILE_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not a response cache snapshot\n", path);
+		munmap((void *)map, st.st_size);
+		return -1;
+	}
+	if (hdr->fingerprint != rcache_fingerprint(server)) {
+		munmap((void *)map, st.st_size);
+		return 0;
+	}
+
+	p = map + sizeof(*hdr);
+	end = map + st.st_size;
+	for (i = 0; i < hdr->count; ++i) {
+		struct rcache_file_entry ent;
+		struct evldns_rcache *rc;
+		uint8_t folded[LDNS_MAX_DOMAINLEN + 1];
+		const uint8_t *qname;
+		uint8_t *wire;
+
+		if (end - p < (ptrdiff_t)sizeof(ent)) {
+			break;
+		}
+		memcpy(&ent, p, sizeof(ent));	/* may be unaligned */
+		p += sizeof(ent);
+		if (ent.qname_len == 0 || ent.qname_len > LDNS_MAX_DOMAINLEN + 1 ||
+			end - p < (ptrdiff_t)ent.qname_len + ent.len)
+		{
+			break;
+		}
+		qname = p;
+		p += ent.qname_len + ent.len;
+
+		if (ent.expires <= now) {
+			continue;
+		}
+
+		/*
+		 * only take responses that rcache_store() would have, since
+		 * rcache_answer() writes the ID and QNAME into them
+		 */
+		if (ent.len < LDNS_HEADER_SIZE + ent.qname_len + 4 ||
+			ldns_read_uint16(qname + ent.qname_len + 4) != 1 ||
+			!evldns_dname_equal(qname + ent.qname_len + LDNS_HEADER_SIZE,
+				ent.qname_len, qname, ent.qname_len))
+		{
+			continue;
+		}
+
+		if (!(wire = malloc(ent.len))) {
+			perror("malloc");
+			break;
+		}
+		memcpy(wire, qname + ent.qname_len, ent.len);
+
+		rc = rcache_bucket(server,
+			evldns_dname_canonical_hash(folded, qname, ent.qname_len),
+			ent.qclass, ent.qtype, ent.flags, (ent.bits >> 1) & 1,
+			(ent.bits >> 2) & 1, ent.edns_size);
+		free(rc->wire);
+		rc->generation = seq;
+		rc->expires = (time_t)ent.expires;
+		rc->qtype = ent.qtype;
+		rc->qclass = ent.qclass;
+		rc->flags = ent.flags;
+		rc->edns_size = ent.edns_size;
+		rc->edns_version = ent.edns_version;
+		rc->edns = ent.bits & 1;
+		rc->edns_do = (ent.bits >> 1) & 1;
+		rc->is_tcp = (ent.bits >> 2) & 1;
+		rc->qname_len = ent.qname_len;
+		memcpy(rc->qname, folded, ent.qname_len);
+		rc->len = ent.len;
+		rc->wire = wire;
+		n++;
+	}
+
+	munmap((void *)map, st.st_size);
+
+	return n;
+}
+
+struct rcache_signal {
+	evldns_server					*server;
+	char							*path;
+	int								 stop;
+};
+
+static void
+rcache_signal_callback(int signum, short events, void *arg)
+{
+	struct rcache_signal *rs = (struct rcache_signal *)arg;
+
+	(void)evldns_save_response_cache(rs->server, rs->path);
+	if (rs->stop) {
+		event_base_loopexit(rs->server->base, NULL);
+	}
+}
+
+/*
+ * saves the response cache to 'path' whenever signal 'signum' arrives,
+ * and then if 'stop' is set makes the event loop exit - e.g. for
+ * SIGTERM so that the snapshot is taken on shutdown
+ */
+int
+evldns_save_cache_on_signal(evldns_server *server, int signum, const char *path, int stop)
+{
+	struct rcache_signal *rs;
+	struct event *ev;
+
+	if (!(rs = calloc(1, sizeof(*rs))) || !(rs->path = strdup(path))) {
+		perror("calloc");
+		free(rs);
+		return -1;
+	}
+	rs->server = server;
+	rs->stop = stop;
+
+	ev = event_new(server->base, signum, EV_SIGNAL | EV_PERSIST,
+		rcache_signal_callback, rs);
+	if (!ev || event_add(ev, NULL) < 0) {
+		fprintf(stderr, "evldns_save_cache_on_signal: can't add signal event\n");
+		if (ev) {
+			event_free(ev);
+		}
+		free(rs->path);
+		free(rs);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-------------------------------------------------------------------*/
+
+static evldns_cb *
+server_add_cb(evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, void *data)
+{
+	evldns_cb *cb = (evldns_cb *)calloc(1, sizeof(evldns_cb));
+	if (!cb) {
+		perror("calloc");
+		return NULL;
+	}
+
+	if (dname != NULL) {
+		if (!(cb->rdf = ldns_dname_new_frm_str(dname))) {
+			fprintf(stderr, "invalid callback name: %s\n", dname);
+			free(cb);
+			return NULL;
+		}
+		ldns_dname2canonical(cb->rdf);
+	}
+	cb->rr_class = rr_class;
+	cb->rr_type = rr_type;
+	cb->data = data;
+
+	if (server_index_cb(server->root, cb) < 0) {
+		ldns_rdf_deep_free(cb->rdf);
+		free(cb);
+		return NULL;
+	}
+	TAILQ_INSERT_TAIL(&server->root->callbacks, cb, next);
+
+	return cb;
+}
+
+void evldns_add_callback(evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, evldns_callback callback, void *data)
+{
+	evldns_cb *cb = server_add_cb(server, dname, rr_class, rr_type, data);
+	if (cb) {
+		cb->callback = callback;
+	}
+}
 
-	ldns_pkt_set_id(p, ldns_pkt_id(req));		/* copy ID field */
+/*
+ * as evldns_add_callback(), but the callback is given the lower-cased
+ * QNAME in wire format, and the ldns format request isn't built for it
+ */
+void evldns_add_name_callback(evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, evldns_name_callback callback, void *data)
+{
+	evldns_cb *cb = server_add_cb(server, dname, rr_class, rr_type, data);
+	if (cb) {
+		cb->name_callback = callback;
+	}
+}
 
-	if (opcode == LDNS_PACKET_QUERY) {
-		ldns_pkt_set_cd(p, ldns_pkt_cd(req));	/* copy CD bit */
-		ldns_pkt_set_rd(p, ldns_pkt_rd(req));	/* copy RD bit */
+/*
+ * as evldns_add_callback(), but the callback is given the request in
+ * wire format and writes its wire format response into a buffer - it
+ * returns the response length, 0 if it didn't answer, or -1 to have
+ * the request blackholed
+ */
+void evldns_add_wire_callback(evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, evldns_wire_callback callback, void *data)
+{
+	evldns_cb *cb = server_add_cb(server, dname, rr_class, rr_type, data);
+	if (cb) {
+		cb->wire_callback = callback;
 	}
+}
 
-	ldns_pkt_set_qr(p, 1);						/* this is a response */
-	ldns_pkt_set_opcode(p, opcode);				/* copy opcode */
-	ldns_pkt_set_rcode(p, rcode);				/* set rcode */
+/*
+ * adds a hook that's called, in the order they're added, on every
+ * wire format response just before it's sent, including responses
+ * from the response cache and evldns' own error responses.  A hook may
+ * change req->wire_response in place (or use evldns_response_reserve()
+ * to make room for more), or return -1 to drop the response.
+ */
+int
+evldns_add_post_hook(evldns_server *server, evldns_post_hook hook, void *data)
+{
+	struct evldns_hook *h;
 
-	ldns_rr_list_deep_free(p->_question);
-	ldns_pkt_set_question(p, q);
-	ldns_pkt_set_qdcount(p, ldns_rr_list_rr_count(q));
+	if (!hook) {
+		return -1;
+	}
+	if (!(h = calloc(1, sizeof(*h)))) {
+		perror("calloc");
+		return -1;
+	}
+	h->hook = hook;
+	h->data = data;
+	TAILQ_INSERT_TAIL(&server->root->post_hooks, h, next);
 
-	if (ldns_pkt_edns(req)) {
-		ldns_pkt_set_edns_udp_size(p, 4096);
-		if (ldns_pkt_edns_do(req)) {
-			ldns_pkt_set_edns_do(p, 1);
-		}
+	return 0;
+}
+
+/*
+ * makes sure that req->wire_response has room for 'len' bytes, moving
+ * it into the request's arena if necessary, and returns it
+ */
+uint8_t *
+evldns_response_reserve(evldns_server_request *req, size_t len)
+{
+	uint8_t *p;
+
+	if (len <= req->wire_resplen) {
+		return req->wire_response;
+	}
+
+	if (!(p = evldns_request_alloc(req, len))) {
+		return NULL;
 	}
+	memcpy(p, req->wire_response, req->wire_resplen);
+	if (!req->wire_arena) {
+		free(req->wire_response);
+	}
+	req->wire_response = p;
+	req->wire_arena = 1;
 
 	return p;
 }
 
-/*-------------------------------------------------------------------*/
-
-static void
-server_port_free(evldns_server_port *port)
+/*
+ * builds the ldns format request the first time it's needed, since
+ * many requests can be answered from the pre-parsed header alone
+ */
+ldns_pkt *
+evldns_request_pkt(evldns_server_request *req)
 {
-	free(port);
+	if (!req->request) {
+		if (ldns_wire2pkt(&req->request, req->wire_request,
+				req->wire_reqlen) != LDNS_STATUS_OK)
+		{
+			req->request = NULL;
+		}
+	}
+
+	return req->request;
 }
 
+/*
+ * calls one callback, returning 1 if it answered (or blackholed) the
+ * request, 0 if it didn't, or -1 if the request can't be parsed
+ */
 static int
-server_request_free(evldns_server_request *req)
+dispatch_invoke(evldns_server_request *req, evldns_callback callback, evldns_name_callback name_callback, void *data)
 {
-	req->port->refcnt--;
+	const struct evldns_query_info *qi = &req->qinfo;
+	ldns_rdf qname;
 
-	ldns_pkt_free(req->request);
-	ldns_pkt_free(req->response);
+	if (name_callback) {
+		(*name_callback)(req, data, req->qname, qi->qname_len,
+			qi->qtype, qi->qclass);
+	} else {
+		/* these callbacks expect the ldns format request */
+		if (!evldns_request_pkt(req)) {
+			return -1;
+		}
 
-	free(req->wire_request);
-	free(req->wire_response);
-	free(req->event);
-	free(req);
+		/* and an ldns_rdf, which just points at the canonical QNAME */
+		ldns_rdf_set_size(&qname, qi->qname_len);
+		ldns_rdf_set_type(&qname, LDNS_RDF_TYPE_DNAME);
+		ldns_rdf_set_data(&qname, req->qname);
 
-	// TODO?: perhaps free port structure on refcnt == 0?
+		(*callback)(req, data, &qname, qi->qtype, qi->qclass);
+	}
 
-	return 0;
+	return (req->response || req->wire_response || req->blackhole) ? 1 : 0;
 }
 
-void evldns_add_callback(evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, evldns_callback callback, void *data)
+/*
+ * calls a wire callback with an output buffer from the request's arena,
+ * returning as dispatch_invoke().  The buffer is only allocated once
+ * per request, and reused by any callbacks tried after one that falls
+ * through.
+ */
+static int
+dispatch_wire(evldns_server_request *req, evldns_wire_callback callback, void *data)
 {
-	evldns_cb *cb = (evldns_cb *)calloc(1, sizeof(evldns_cb));
-	if (!cb) {
-		perror("calloc");
-		return;
+	size_t outlen = req->is_tcp ? LDNS_MAX_PACKETLEN : EVLDNS_WIRE_BUFSIZE;
+	uint8_t *out = req->wire_out;
+	int r;
+
+	if (!out) {
+		if (!(out = evldns_request_alloc(req, outlen))) {
+			return -1;
+		}
+		req->wire_out = out;
 	}
 
-	if (dname != NULL) {
-		cb->rdf = ldns_dname_new_frm_str(dname);
-		ldns_dname2canonical(cb->rdf);
+	r = (*callback)(req, data, &req->qinfo, out, outlen);
+	if (r < 0) {
+		req->blackhole = 1;
+		return 1;
+	} else if (r == 0) {
+		return 0;
+	} else if ((size_t)r > outlen) {
+		return -1;
 	}
-	cb->rr_class = rr_class;
-	cb->rr_type = rr_type;
-	cb->callback = callback;
-	cb->data = data;
-	TAILQ_INSERT_TAIL(&server->callbacks, cb, next);
+
+	req->wire_response = out;
+	req->wire_resplen = r;
+	req->wire_arena = 1;
+
+	return 1;
 }
 
-static void
-dispatch_callbacks(struct evldnscbq *callbacks, evldns_server_request *req)
+static int
+dispatch_one(evldns_cb *cb, evldns_server_request *req)
 {
-	evldns_cb *cb;
-	ldns_pkt *pkt = req->request;
-	ldns_rr *q = ldns_rr_list_rr(ldns_pkt_question(pkt), 0);
-	if (q) {
-		ldns_rr_type qtype = ldns_rr_get_type(q);
-		ldns_rr_class qclass = ldns_rr_get_class(q);
-		ldns_rdf *qname = ldns_dname_clone_from(ldns_rr_owner(q), 0);
-		ldns_dname2canonical(qname);
-
-		TAILQ_FOREACH(cb, callbacks, next) {
-			if ((cb->rr_class != LDNS_RR_CLASS_ANY) &&
-		    	(cb->rr_class != ldns_rr_get_class(q)))
-			{
-				continue;
-			}
+	if (cb->wire_callback) {
+		return dispatch_wire(req, cb->wire_callback, cb->data);
+	}
+	return dispatch_invoke(req, cb->callback, cb->name_callback, cb->data);
+}
 
-			/* TODO: dispatch if request QTYPE == ANY? */
-			if ((cb->rr_type != LDNS_RR_TYPE_ANY) &&
-		    	(cb->rr_type != ldns_rr_get_type(q)))
-			{
-				continue;
-			}
+/*
+ * calls 'callback' as if it had been registered for the request's
+ * question, e.g. from a matcher.  Returns as dispatch_invoke().
+ */
+int
+evldns_dispatch_callback(evldns_server_request *req, evldns_callback callback, void *data)
+{
+	return dispatch_invoke(req, callback, NULL, data);
+}
 
-			if (cb->rdf) {
-				if (!ldns_dname_match_wildcard(qname, cb->rdf)) {
-					continue;
-				}
-			}
+int
+evldns_dispatch_wire_callback(evldns_server_request *req, evldns_wire_callback callback, void *data)
+{
+	return dispatch_wire(req, callback, data);
+}
 
-			(*cb->callback)(req, cb->data, qname, qtype, qclass);
+/*
+ * installs a function that's given each request (with its canonical
+ * QNAME in req->qname) before the callback table is searched - see
+ * matchgen.c.  The table is only searched if the matcher doesn't
+ * answer the request.
+ */
+void
+evldns_set_matcher(evldns_server *server, evldns_matcher matcher, void *data)
+{
+	evldns_server *root = server->root;
 
-			if (req->response || req->wire_response || req->blackhole) {
-				break;
+	root->matcher = matcher;
+	root->matcher_data = data;
+	root->cb_seq++;		/* invalidates dispatch memos */
+}
+
+/*
+ * finds and calls the callbacks for a request whose canonical QNAME
+ * (with hash 'qname_hash') is in req->qname
+ */
+static int
+dispatch_callbacks(evldns_server *server, evldns_server_request *req, uint32_t qname_hash)
+{
+	evldns_server *root = server->root;
+	evldns_cb *cb, *skip = NULL, *cursors[INDEX_CURSORS];
+	const struct evldns_query_info *qi = &req->qinfo;
+	ldns_rr_type qtype = qi->qtype;
+	ldns_rr_class qclass = qi->qclass;
+	struct evldns_memo *memo = NULL;
+	int i, best, ncursors, r = 0;
+
+	/* a compiled matcher goes first */
+	if (root->matcher) {
+		if ((*root->matcher)(req, root->matcher_data) < 0) {
+			return -1;
+		}
+		if (req->response || req->wire_response || req->blackhole) {
+			return 0;
+		}
+	}
+
+	/*
+	 * try the entry that answered this question last time.  If it
+	 * doesn't answer this time the rest of the table is searched as
+	 * usual.
+	 */
+	if (server->memo_size) {
+		memo = memo_slot(server, req, qname_hash);
+		if (memo->generation == root->cb_seq + 1 && memo_match(memo, req)) {
+			server->memo_hits++;
+			if ((r = dispatch_one(memo->cb, req)) != 0) {
+				return r < 0 ? r : 0;
+			}
+			skip = memo->cb;
+		} else {
+			server->memo_misses++;
+		}
+	}
+
+	/*
+	 * take the matching entries from the index lists in registration
+	 * order, moving on to the next one while nothing has answered
+	 *
+	 * TODO: dispatch if request QTYPE == ANY?
+	 */
+	ncursors = index_lookup(root, req->qname, qi->qname_len, qname_hash,
+		qclass, qtype, cursors);
+	for (;;) {
+		for (i = 0, best = -1; i < ncursors; ++i) {
+			if (cursors[i] && (best < 0 || cursors[i]->seq < cursors[best]->seq)) {
+				best = i;
 			}
 		}
+		if (best < 0) {
+			cb = NULL;
+			break;
+		}
+		cb = cursors[best];
+		cursors[best] = index_next(cb->inext, qclass, qtype);
+
+		if (cb == skip) {
+			continue;
+		}
+		if ((r = dispatch_one(cb, req)) != 0) {
+			break;
+		}
+	}
 
-		ldns_rdf_deep_free(qname);
+	if (r < 0) {
+		return r;
+	}
+	if (memo) {
+		if (cb) {
+			memo_store(memo, req, cb, root->cb_seq);
+		} else if (skip) {
+			memo->generation = 0;
+		}
 	}
+
+	return 0;
 }
 
+/*
+ * Requests are processed in three stages: parsing the header, calling
+ * the callbacks, and converting ldns format responses to wire format.
+ * Each stage returns STAGE_NEXT if the request needs the next stage,
+ * or else the final result: 0 if there's a wire format response to
+ * send, -1 if the request should be dropped, or -2 to blackhole it.
+ */
+#define STAGE_NEXT		1
+
+#if defined(__GNUC__)
+#define PREFETCH(p)		__builtin_prefetch(p)
+#else
+#define PREFETCH(p)		((void)0)
+#endif
+
 static int
-server_process_packet(evldns_server_request *req)
+stage_parse(evldns_server_request *req)
 {
-	uint8_t *buffer = req->wire_request;
-	size_t buflen = req->wire_reqlen;
+	const struct evldns_query_info *qi = &req->qinfo;
+	evldns_server *server = req->port->server;
 
 	req->port->refcnt++;
+	req->cache_set = 0;
+	req->cache_store = 0;
+	req->udp_max = server->udp_max;
 
 	/*
 	 * dispose of the previous packet buffers if they're still around
@@ -678,23 +3330,66 @@ server_process_packet(evldns_server_request *req)
 	}
 
 	/*
-	 * convert the received packet into ldns format
+	 * check the header and find the question without involving
+	 * ldns, dropping anything that doesn't parse
 	 */
-	if (ldns_wire2pkt(&req->request, buffer, buflen) != LDNS_STATUS_OK) {
+	if (evldns_parse_query(req->wire_request, req->wire_reqlen, &req->qinfo) < 0) {
 		return -1;
 	}
 
 	/*
 	 * don't respond to responses
 	 */
-	if (ldns_pkt_qr(req->request)) {
+	if (LDNS_QR_WIRE(req->wire_request)) {
 		return -1;
 	}
 
 	/*
-	 * send it to the callback chain
+	 * reject anything other than a single-question QUERY
+	 */
+	if (server->query_only) {
+		if (qi->qdcount != 1) {
+			return server_error_response(req, LDNS_RCODE_FORMERR);
+		}
+		if (LDNS_OPCODE_WIRE(req->wire_request) != LDNS_PACKET_QUERY) {
+			return server_error_response(req, LDNS_RCODE_NOTIMPL);
+		}
+	}
+
+	return STAGE_NEXT;
+}
+
+static int
+stage_dispatch(evldns_server_request *req)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+	evldns_server *server = req->port->server;
+
+	/*
+	 * answer from the response cache, or else send it to the
+	 * callback chain
 	 */
-	dispatch_callbacks(&req->port->server->callbacks, req);
+	if (qi->qdcount > 0) {
+		/* the canonical QNAME lives in the request */
+		uint32_t qname_hash = evldns_dname_canonical_hash(req->qname,
+			req->wire_request + qi->qname_offset, qi->qname_len);
+
+		if (server->rcache_size && qi->qdcount == 1) {
+			struct evldns_rcache *rc = rcache_slot(server, req, qname_hash);
+			if (rc->generation == server->root->cb_seq + 1 &&
+				rcache_match(rc, req) && rc->expires > time(NULL))
+			{
+				server->rcache_hits++;
+				return rcache_answer(rc, req);
+			}
+			server->rcache_misses++;
+			req->cache_store = 1;
+		}
+
+		if (dispatch_callbacks(server, req, qname_hash) < 0) {
+			return -1;
+		}
+	}
 
 	/*
 	 * blackhole the request if the callback chain didn't want to answer it
@@ -704,30 +3399,192 @@ server_process_packet(evldns_server_request *req)
 		return -2;
 	}
 
+	if (req->wire_response) {
+		return 0;
+	}
+
 	/*
-	 * if the callbacks didn't generate a wire-format response
-	 * then do the necessary stuff here
+	 * if the callbacks didn't even create an ldns format
+	 * response then return a default (REFUSED) response
 	 */
-	if (!req->wire_response) {
+	if (!req->response) {
+		return server_error_response(req, LDNS_RCODE_REFUSED);
+	}
 
-		/*
-		 * if the callbacks didn't even create an ldns format
-		 * response then return a default (REFUSED) ldns response
-		 */
-		if (!req->response) {
-			req->response = evldns_response(req->request,
-				LDNS_RCODE_REFUSED);
+	return STAGE_NEXT;
+}
+
+static int
+stage_serialize(evldns_server_request *req)
+{
+	ldns_status status;
+
+	/* responses advertise the server's limit, not evldns_response()'s default */
+	if (ldns_pkt_edns(req->response)) {
+		ldns_pkt_set_edns_udp_size(req->response, req->udp_max);
+	}
+
+	/*
+	 * convert from ldns format to wire format
+	 */
+	status = ldns_pkt2wire(&req->wire_response,
+		req->response, &req->wire_resplen);
+	if (status != LDNS_STATUS_OK) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * makes a UDP response fit the client's EDNS buffer size (or 512 bytes
+ * without EDNS), capped at the server's maximum.  One pass over the
+ * response finds where each section starts and where the OPT record
+ * is, and then the response is cut back to just before the additional
+ * section, or failing that the authority section, with the OPT record
+ * moved up behind it.  If even that's too big the answers go too and
+ * TC is set.  TC is also set if the authority section goes from a
+ * response without answers, since for NXDOMAIN, NODATA or a referral
+ * that's the part that matters.  Since only whole sections are removed
+ * from the end any compression pointers in what's left still work.
+ */
+static void
+stage_fit(evldns_server_request *req)
+{
+	const struct evldns_query_info *qi = &req->qinfo;
+	uint8_t *w = req->wire_response;
+	size_t len = req->wire_resplen;
+	size_t limit = 512, off, start[4], opt = 0, optlen = 0;
+	unsigned int i, n, section;
+
+	if (qi->edns) {
+		limit = (qi->edns_size > 512) ? qi->edns_size : 512;
+		if (limit > req->port->server->udp_max) {
+			limit = req->port->server->udp_max;
 		}
+	}
+	if (req->is_tcp || len <= limit || len < LDNS_HEADER_SIZE) {
+		return;
+	}
 
-		/*
-		 * convert from ldns format to wire format
-		 */
-		ldns_status status = ldns_pkt2wire(&req->wire_response,
-			req->response, &req->wire_resplen);
-		if (status != LDNS_STATUS_OK) {
-			return -1;
+	/* find the sections, and the OPT record in the additional section */
+	off = LDNS_HEADER_SIZE;
+	for (n = ldns_read_uint16(w + 4); n > 0; --n) {
+		if (!(off = wire_skip_name(w, len, off)) || (off += 4) > len) {
+			return;
+		}
+	}
+	for (section = LDNS_SECTION_ANSWER; section <= LDNS_SECTION_ADDITIONAL; ++section) {
+		start[section] = off;
+		for (n = ldns_read_uint16(w + 4 + 2 * section); n > 0; --n) {
+			size_t rr = off;
+			if (!(off = wire_skip_name(w, len, off)) || off + 10 > len) {
+				return;
+			}
+			if (section == LDNS_SECTION_ADDITIONAL &&
+				ldns_read_uint16(w + off) == LDNS_RR_TYPE_OPT)
+			{
+				opt = rr;
+				optlen = off + 10 + ldns_read_uint16(w + off + 8) - rr;
+			}
+			if ((off += 10 + ldns_read_uint16(w + off + 8)) > len) {
+				return;
+			}
+		}
+	}
+
+	/* see how much has to go */
+	for (section = LDNS_SECTION_ADDITIONAL; section > LDNS_SECTION_ANSWER; --section) {
+		if (start[section] + optlen <= limit) {
+			break;
+		}
+	}
+	if (start[section] + optlen > limit) {
+		return;		/* the question alone is too big */
+	}
+
+	memmove(w + start[section], w + opt, optlen);
+	req->wire_resplen = start[section] + optlen;
+	for (i = section; i <= LDNS_SECTION_ADDITIONAL; ++i) {
+		ldns_write_uint16(w + 4 + 2 * i, 0);
+	}
+	if (optlen) {
+		ldns_write_uint16(w + 10, 1);
+	}
+	if (section == LDNS_SECTION_ANSWER ||
+		(section == LDNS_SECTION_AUTHORITY && !ldns_read_uint16(w + 6)))
+	{
+		LDNS_TC_SET(w);
+	}
+}
+
+/*
+ * runs the post hooks over the final wire format response, which has
+ * already been cached if it's going to be - UDP responses are fitted
+ * again afterwards in case a hook made them bigger
+ */
+static int
+stage_post_hooks(evldns_server_request *req)
+{
+	evldns_server *root = req->port->server->root;
+	struct evldns_hook *h;
+
+	TAILQ_FOREACH(h, &root->post_hooks, next) {
+		if ((*h->hook)(req, h->data) < 0) {
+			return -2;
 		}
 	}
 
 	return 0;
 }
+
+/*
+ * runs each stage over the whole batch before starting the next one,
+ * leaving each request's result in 'results'
+ */
+static void
+server_process_batch(evldns_server_request **reqs, int *results, int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (i + 1 < count) {
+			PREFETCH(reqs[i + 1]->wire_request);
+		}
+		results[i] = stage_parse(reqs[i]);
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (results[i] == STAGE_NEXT) {
+			results[i] = stage_dispatch(reqs[i]);
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (results[i] == STAGE_NEXT) {
+			results[i] = stage_serialize(reqs[i]);
+		}
+		if (results[i] == 0) {
+			stage_fit(reqs[i]);
+		}
+		if (results[i] == 0 && reqs[i]->cache_store) {
+			rcache_store(reqs[i]->port->server, reqs[i]);
+		}
+		if (results[i] == 0) {
+			results[i] = stage_post_hooks(reqs[i]);
+		}
+		if (results[i] == 0) {
+			stage_fit(reqs[i]);		/* again, in case a hook added to it */
+		}
+	}
+}
+
+static int
+server_process_packet(evldns_server_request *req)
+{
+	int result;
+
+	server_process_batch(&req, &result, 1);
+
+	return result;
+}
@@ -39,13 +39,94 @@ extern "C" {
 #include <event.h>
 #include <ldns/ldns.h>
 
+/* the largest number of datagrams handled per batched UDP system call */
+#define EVLDNS_MAX_BATCH		256
+
+/* the default receive buffer size for pooled UDP request objects */
+#define EVLDNS_POOL_BUFSIZE		4096
+
+/* the default number of UDP request objects a port keeps for reuse */
+#define EVLDNS_POOL_DEFAULT		256
+
+/* the size of a request's first arena chunk, and the most it may keep */
+#define EVLDNS_ARENA_SIZE		4096
+#define EVLDNS_ARENA_MAX		65536
+
+/* the default largest UDP response, and the EDNS buffer size advertised */
+#define EVLDNS_UDP_MAX_DEFAULT	1232
+
+/* the size of the output buffer given to wire callbacks for UDP */
+#define EVLDNS_WIRE_BUFSIZE		4096
+
+/* the number of name offsets a response builder keeps for compression */
+#define EVLDNS_BUILDER_NAMES	32
+
+/* the default number of packets a port may handle per event loop wakeup */
+#define EVLDNS_DEFAULT_BUDGET	64
+
+/* the default length of a UDP port's unsent response queue */
+#define EVLDNS_SENDQ_DEFAULT	1024
+
+/* socket option flags - see struct evldns_sockopts */
+#define EVLDNS_SOCK_REUSEPORT	0x0001
+#define EVLDNS_SOCK_BUSY_POLL	0x0002
+#define EVLDNS_SOCK_PMTUDISC_OMIT	0x0004		/* UDP: ignore path MTU discovery */
+#define EVLDNS_SOCK_RXQ_OVFL	0x0008		/* UDP: report kernel drop counts */
+#define EVLDNS_SOCK_PKTINFO		0x0010		/* UDP: reply from the query's address */
+
+/* kernel packet filter rules - see socket_attach_filter() */
+#define EVLDNS_FILTER_SHORT		0x0001		/* shorter than a DNS header */
+#define EVLDNS_FILTER_QR		0x0002		/* responses */
+#define EVLDNS_FILTER_OPCODE	0x0004		/* OPCODE != QUERY */
+#define EVLDNS_FILTER_QDCOUNT	0x0008		/* QDCOUNT != 1 */
+#define EVLDNS_FILTER_ALL		0x000f
+
+/* the default SO_BUSY_POLL time for EVLDNS_SOCK_BUSY_POLL sockets */
+#define EVLDNS_BUSY_POLL_USEC	50
+
+/* the default time evldns_server_poll() spins before sleeping */
+#define EVLDNS_POLL_IDLE_USEC	1000
+
+/* worker placement flags - see struct evldns_worker_config */
+#define EVLDNS_WORKER_PIN_CPU	0x0001		/* pin each worker to its CPU */
+#define EVLDNS_WORKER_NUMA_LOCAL	0x0002		/* allocate on the worker's NUMA node */
+#define EVLDNS_WORKER_CPU_STEER	0x0004		/* steer packets to the receiving CPU's worker */
+#define EVLDNS_WORKER_BUSY_POLL	0x0008		/* run with evldns_server_poll() */
+
 /* forward declarations */
 struct evldns_server;
 struct evldns_server_port;
 struct evldns_server_request;
+struct evldns_workers;
 
 /* type declarations */
 
+/*
+ * the header, first question and EDNS details of a request, as found
+ * by evldns_parse_query() without building an ldns_pkt
+ */
+struct evldns_query_info {
+	uint16_t					 id;
+	uint16_t					 flags;			/* header flags word */
+	uint16_t					 qdcount;
+	uint16_t					 ancount;
+	uint16_t					 nscount;
+	uint16_t					 arcount;
+
+	/* the first question - the name is uncompressed, as received */
+	uint16_t					 qname_offset;
+	uint16_t					 qname_len;		/* including the root label */
+	uint16_t					 qtype;
+	uint16_t					 qclass;
+	uint16_t					 question_end;	/* offset past all questions */
+
+	/* the OPT record, if any */
+	uint16_t					 edns_size;
+	uint8_t						 edns_version;
+	uint8_t						 edns:1;
+	uint8_t						 edns_do:1;
+};
+
 struct evldns_server_request {
 
 	/* the parent server */
@@ -59,7 +140,18 @@ struct evldns_server_request {
 	struct sockaddr_storage		 addr;
 	socklen_t					 addrlen;
 
-	/* formatted DNS packets */
+	/* the address the request was sent to (UDP with EVLDNS_SOCK_PKTINFO) */
+	struct sockaddr_storage		 local_addr;
+	socklen_t					 local_addrlen;
+	unsigned int				 local_ifindex;
+
+	/* the pre-parsed request */
+	struct evldns_query_info	 qinfo;
+
+	/* the lower-cased QNAME in wire format, qinfo.qname_len long */
+	uint8_t						 qname[LDNS_MAX_DOMAINLEN + 1];
+
+	/* formatted DNS packets - use evldns_request_pkt() for 'request' */
 	ldns_pkt					*request;
 	ldns_pkt					*response;
 
@@ -77,14 +169,139 @@ struct evldns_server_request {
 	uint8_t						 wire_resphead:2;
 	uint8_t						 is_tcp:1;
 	uint8_t						 blackhole:1;
+	uint8_t						 pooled:1;
+	uint8_t						 wire_arena:1;	/* wire_response is in the arena */
+	uint8_t						 cache_set:1;	/* cache_ttl has been set */
+	uint8_t						 cache_store:1;	/* response cache miss */
+
+	/* how long the response may be cached - see evldns_set_cache_ttl() */
+	uint32_t					 cache_ttl;
+
+	/* the UDP size advertised in OPT RRs - see evldns_set_udp_max() */
+	uint16_t					 udp_max;
 
-	/* pending requests for UDP mode */
+	/* transient memory - see evldns_request_alloc() */
+	struct evldns_arena_chunk	*arena;
+
+	/* the wire callbacks' output buffer, in the arena */
+	uint8_t						*wire_out;
+
+	/* free list linkage for pooled UDP requests, or the port's TCP connections */
 	TAILQ_ENTRY(evldns_server_request) next;
 };
 typedef struct evldns_server_request evldns_server_request;
 
+/* a wire format response under construction - see builder.c */
+struct evldns_builder {
+	uint8_t						*buf;
+	size_t						 len;
+	size_t						 max;
+	size_t						 reserve;	/* kept back for the OPT RR */
+	uint16_t					 udp_max;	/* advertised in the OPT RR */
+	ldns_pkt_section			 section;	/* of the last RR added */
+	uint8_t						 edns:1;	/* the request had an OPT RR */
+	uint8_t						 edns_do:1;
+	uint8_t						 opt:1;		/* an OPT RR has been added */
+	uint8_t						 truncated:1;
+	unsigned int				 nnames;
+	uint16_t					 names[EVLDNS_BUILDER_NAMES];
+};
+
+/* what to do when a UDP port's send queue is full */
+enum evldns_queue_policy {
+	EVLDNS_QUEUE_DROP_NEWEST,		/* discard the response being queued */
+	EVLDNS_QUEUE_DROP_OLDEST,		/* discard the oldest queued response */
+	EVLDNS_QUEUE_STOP_READING		/* stop reading until the queue drains */
+};
+
+/* per-port statistics - see evldns_get_port_stats() */
+struct evldns_port_stats {
+
+	/* UDP request object pool */
+	unsigned int				 pool_size;
+	size_t						 pool_bufsize;
+	unsigned int				 pool_free;
+	unsigned int				 pool_in_use;
+	unsigned int				 pool_high_water;
+	uint64_t					 pool_allocs;
+	uint64_t					 pool_reuses;
+
+	/* UDP datagrams received, and dropped by the kernel */
+	uint64_t					 rx_packets;
+	uint32_t					 kernel_drops;		/* needs EVLDNS_SOCK_RXQ_OVFL */
+	uint32_t					 socket_drops;		/* now, including filtered packets */
+
+	/* per-wakeup I/O budget (0 = unlimited) */
+	unsigned int				 budget;
+	uint64_t					 budget_exhausted;
+
+	/* UDP send queue */
+	unsigned int				 sendq_cap;
+	unsigned int				 sendq_len;
+	unsigned int				 sendq_high_water;
+	uint64_t					 sendq_drops;
+	uint64_t					 sendq_stalls;
+};
+
+/* optional socket settings for the bind_to_*_opts() functions */
+struct evldns_sockopts {
+	unsigned int				 flags;
+	int							 rcvbuf;			/* SO_RCVBUF, if non-zero */
+	int							 sndbuf;			/* SO_SNDBUF, if non-zero */
+	int							 busy_poll_usec;	/* 0 for EVLDNS_BUSY_POLL_USEC */
+	unsigned int				 filter;			/* UDP: EVLDNS_FILTER_* rules */
+};
+
+/* settings for evldns_workers_start() */
+struct evldns_worker_config {
+	int							 nworkers;
+	const char					*addr;		/* NULL for all addresses */
+	const char					*port;
+	int							 backlog;
+
+	/* placement - 'cpus' lists each worker's CPU, or NULL for 0 .. n-1 */
+	unsigned int				 flags;
+	const int					*cpus;
+
+	/* with EVLDNS_WORKER_BUSY_POLL, how long to spin before sleeping */
+	unsigned int				 poll_idle_usec;	/* 0 for EVLDNS_POLL_IDLE_USEC */
+
+	/* optional socket settings (EVLDNS_SOCK_REUSEPORT is always added) */
+	const struct evldns_sockopts	*sockopts;
+
+	/* optionally called for each port as each worker creates it */
+	void						(*port_init)(struct evldns_server_port *port, int worker, void *arg);
+	void						*arg;
+};
+
+/* busy polling statistics - see evldns_get_poll_stats() */
+struct evldns_poll_stats {
+	uint64_t					 spins;		/* passes that found no datagrams */
+	uint64_t					 busy;		/* passes that found some */
+	uint64_t					 sleeps;	/* times the loop fell back to blocking */
+};
+
+/* dispatch memo statistics - see evldns_get_dispatch_stats() */
+struct evldns_dispatch_stats {
+	unsigned int				 size;		/* 0 if the memo is disabled */
+	uint64_t					 hits;
+	uint64_t					 misses;
+};
+
+/* response cache statistics - see evldns_set_response_cache() */
+struct evldns_cache_stats {
+	unsigned int				 size;		/* 0 if the cache is disabled */
+	uint64_t					 hits;
+	uint64_t					 misses;
+	uint64_t					 stores;
+};
+
 typedef void (*evldns_callback)(evldns_server_request *request, void *data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass);
+typedef void (*evldns_name_callback)(evldns_server_request *request, void *data, const uint8_t *qname, size_t qname_len, ldns_rr_type qtype, ldns_rr_class qclass);
+typedef int (*evldns_wire_callback)(evldns_server_request *request, void *data, const struct evldns_query_info *qinfo, uint8_t *out, size_t outlen);
 typedef int (*evldns_plugin_init)(struct evldns_server *p);
+typedef int (*evldns_post_hook)(evldns_server_request *request, void *data);
+typedef int (*evldns_matcher)(evldns_server_request *request, void *data);
 
 /*
  * exported functions
@@ -92,32 +309,94 @@ typedef int (*evldns_plugin_init)(struct evldns_server *p);
 
 /* core evdns sort-of-clone functions */
 struct evldns_server *evldns_add_server(struct event_base *);
+struct evldns_server *evldns_add_server_shared(struct event_base *, struct evldns_server *parent);
 struct evldns_server_port *evldns_add_server_port(struct evldns_server *, int socket);
+void evldns_free_server(struct evldns_server *);
 void evldns_server_close(struct evldns_server_port *port);
+void evldns_set_io_budget(struct evldns_server *server, unsigned int budget, unsigned int udp_weight, unsigned int tcp_weight);
+void evldns_set_port_weight(struct evldns_server_port *port, unsigned int weight);
+int evldns_set_batch_size(struct evldns_server_port *port, unsigned int size, int adaptive);
+int evldns_set_request_pool(struct evldns_server_port *port, unsigned int size, size_t bufsize);
+int evldns_set_send_queue(struct evldns_server_port *port, unsigned int size, enum evldns_queue_policy policy);
+void evldns_get_port_stats(struct evldns_server_port *port, struct evldns_port_stats *stats);
 void evldns_add_callback(struct evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, evldns_callback callback, void *data);
+void evldns_set_matcher(struct evldns_server *server, evldns_matcher matcher, void *data);
+int evldns_dispatch_callback(struct evldns_server_request *req, evldns_callback callback, void *data);
+void evldns_add_name_callback(struct evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, evldns_name_callback callback, void *data);
+void evldns_add_wire_callback(struct evldns_server *server, const char *dname, ldns_rr_class rr_class, ldns_rr_type rr_type, evldns_wire_callback callback, void *data);
+int evldns_dispatch_wire_callback(struct evldns_server_request *req, evldns_wire_callback callback, void *data);
+int evldns_add_post_hook(struct evldns_server *server, evldns_post_hook hook, void *data);
+uint8_t *evldns_response_reserve(struct evldns_server_request *req, size_t len);
 ldns_pkt *evldns_response(const ldns_pkt *request, ldns_pkt_rcode rcode);
+void evldns_set_query_only(struct evldns_server *server, int enable);
+void evldns_set_pipeline(struct evldns_server *server, int enable);
+void evldns_set_udp_max(struct evldns_server *server, uint16_t size);
+int evldns_parse_query(const uint8_t *wire, size_t len, struct evldns_query_info *info);
+ldns_pkt *evldns_request_pkt(struct evldns_server_request *req);
+void *evldns_request_alloc(struct evldns_server_request *req, size_t size);
+int evldns_set_dispatch_cache(struct evldns_server *server, unsigned int size);
+void evldns_get_dispatch_stats(struct evldns_server *server, struct evldns_dispatch_stats *stats);
+int evldns_set_response_cache(struct evldns_server *server, unsigned int size, uint32_t ttl);
+void evldns_get_cache_stats(struct evldns_server *server, struct evldns_cache_stats *stats);
+void evldns_set_cache_ttl(struct evldns_server_request *req, uint32_t ttl);
+int evldns_save_response_cache(struct evldns_server *server, const char *path);
+int evldns_load_response_cache(struct evldns_server *server, const char *path);
+int evldns_save_cache_on_signal(struct evldns_server *server, int signum, const char *path, int stop);
 
 /* not-core network function - binds to a list of fds */
 void evldns_add_server_ports(struct evldns_server *, const int *sockets);
 
+/* busy-polling event loop */
+int evldns_server_poll(struct evldns_server *server, unsigned int idle_usec);
+void evldns_server_poll_break(struct evldns_server *server);
+void evldns_get_poll_stats(struct evldns_server *server, struct evldns_poll_stats *stats);
+
+/* multi-threaded operation */
+extern struct evldns_workers *evldns_workers_start(struct evldns_server *server, const struct evldns_worker_config *config);
+extern void evldns_workers_stop(struct evldns_workers *workers);
+
 /* plugin and function handling functions */
 extern void evldns_init(void);
 extern int evldns_load_plugin(struct evldns_server *server, const char *plugin);
 extern void evldns_add_function(const char *name, evldns_callback func);
 extern evldns_callback evldns_get_function(const char *name);
+extern void evldns_add_wire_function(const char *name, evldns_wire_callback func);
+extern evldns_wire_callback evldns_get_wire_function(const char *name);
+extern void evldns_add_hook_function(const char *name, evldns_post_hook hook);
+extern evldns_post_hook evldns_get_hook_function(const char *name);
+
+/* wire format domain name functions */
+extern void evldns_dname_canonical(uint8_t *dst, const uint8_t *src, size_t len);
+extern int evldns_dname_equal(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen);
+extern uint32_t evldns_dname_canonical_hash(uint8_t *dst, const uint8_t *src, size_t len);
+extern const char *evldns_dname_impl(void);
+
+/* wire format response builder */
+extern int evldns_builder_init(struct evldns_builder *b, uint8_t *buf, size_t max, const struct evldns_server_request *req, ldns_pkt_rcode rcode);
+extern int evldns_builder_rr(struct evldns_builder *b, ldns_pkt_section section, const uint8_t *owner, ldns_rr_type rr_type, ldns_rr_class rr_class, uint32_t ttl, const uint8_t *rdata, size_t rdlen);
+extern int evldns_builder_opt(struct evldns_builder *b, uint16_t udp_size, int do_bit);
+extern int evldns_builder_finish(struct evldns_builder *b);
 
 /* miscellaneous utility functions */
 extern int bind_to_sockaddr(struct sockaddr *addr, socklen_t addrlen, int type, int backlog);
+extern int bind_to_sockaddr_opts(struct sockaddr *addr, socklen_t addrlen, int type, int backlog, const struct evldns_sockopts *opts);
 extern int bind_to_address(const char *addr, const char *port, int type, int backlog);
+extern int bind_to_address_opts(const char *addr, const char *port, int type, int backlog, const struct evldns_sockopts *opts);
 extern int bind_to_udp_address(const char *addr, const char *port);
 extern int bind_to_tcp_address(const char *addr, const char *port, int backlog);
 extern int bind_to_port(int port, int family, int type, int backlog);
+extern int bind_to_port_opts(int port, int family, int type, int backlog, const struct evldns_sockopts *opts);
 extern int bind_to_udp4_port(int port);
 extern int bind_to_udp6_port(int port);
 extern int bind_to_tcp4_port(int port, int backlog);
 extern int bind_to_tcp6_port(int port, int backlog);
 extern int *bind_to_all(const char *addr, const char *port, int backlog);
+extern int *bind_to_wildcard(const char *port, int backlog, const struct evldns_sockopts *opts);
+extern int *bind_to_all_opts(const char *addr, const char *port, int backlog, const struct evldns_sockopts *opts);
 extern int socket_is_tcp(int fd);
+extern int socket_steer_by_cpu(int fd, const int *cpus, int count);
+extern int socket_attach_filter(int fd, unsigned int rules);
+extern int socket_drop_count(int fd, uint32_t *drops);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,305 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009-2014, Nominet UK.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Nominet UK nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY Nominet UK ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Nominet UK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Regression tests for "make check".  Queries are fed to a server
+ * through a datagram socketpair and answered by wire callbacks, so
+ * that everything goes through the public API:
+ *
+ *  - UDP request objects and their arenas are recycled through the
+ *    port's pool, and the server can be torn down afterwards
+ *  - registering a callback invalidates the dispatch memo, and
+ *    questions that nothing answered aren't remembered
+ *  - the response builder compresses names, and sets TC only when
+ *    an answer (or the authority section of a negative response)
+ *    doesn't fit
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <evldns.h>
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* the query "foo.example IN A" */
+static const uint8_t foo_query[] = {
+	0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	3, 'f', 'o', 'o', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0,
+	0x00, 0x01, 0x00, 0x01
+};
+
+struct test_server {
+	struct event_base			*base;
+	struct evldns_server		*server;
+	struct evldns_server_port	*port;
+	int							 socket;
+	int							 client;
+};
+
+static int
+test_server_new(struct test_server *t)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	(void)fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+	t->base = event_base_new();
+	t->server = evldns_add_server(t->base);
+	t->port = evldns_add_server_port(t->server, sv[0]);
+	t->socket = sv[0];
+	t->client = sv[1];
+
+	return (t->base && t->server && t->port) ? 0 : -1;
+}
+
+static void
+test_server_free(struct test_server *t)
+{
+	evldns_free_server(t->server);
+	event_base_free(t->base);
+	close(t->socket);
+	close(t->client);
+}
+
+/*
+ * sends foo_query and returns the RCODE of the response, or -1 if there
+ * wasn't one
+ */
+static int
+test_query(struct test_server *t, uint8_t *resp, size_t resplen)
+{
+	ssize_t len;
+
+	if (send(t->client, foo_query, sizeof(foo_query), 0) < 0) {
+		perror("send");
+		return -1;
+	}
+	(void)event_base_loop(t->base, EVLOOP_NONBLOCK);
+
+	len = recv(t->client, resp, resplen, MSG_DONTWAIT);
+	if (len < LDNS_HEADER_SIZE) {
+		return -1;
+	}
+
+	return LDNS_RCODE_WIRE(resp);
+}
+
+/* answers with an A record, using the request arena along the way */
+static int
+a_callback(evldns_server_request *req, void *data, const struct evldns_query_info *qinfo, uint8_t *out, size_t outlen)
+{
+	static const uint8_t addr[4] = { 192, 0, 2, 1 };
+	size_t *scratch = data;
+	struct evldns_builder b;
+
+	if (scratch && !evldns_request_alloc(req, *scratch)) {
+		return -1;
+	}
+
+	evldns_builder_init(&b, out, outlen, req, LDNS_RCODE_NOERROR);
+	evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_A,
+		LDNS_RR_CLASS_IN, 3600, addr, sizeof(addr));
+
+	return evldns_builder_finish(&b);
+}
+
+/* declines to answer the first time it's asked */
+static int
+late_callback(evldns_server_request *req, void *data, const struct evldns_query_info *qinfo, uint8_t *out, size_t outlen)
+{
+	int *calls = data;
+
+	if ((*calls)++ == 0) {
+		return 0;
+	}
+	return a_callback(req, NULL, qinfo, out, outlen);
+}
+
+static void
+test_pool(void)
+{
+	struct test_server t;
+	struct evldns_port_stats stats;
+	size_t scratch = 1000;
+	uint8_t resp[512];
+	int i;
+
+	if (test_server_new(&t) < 0) {
+		failures++;
+		return;
+	}
+	evldns_add_wire_callback(t.server, "foo.example", LDNS_RR_CLASS_IN,
+		LDNS_RR_TYPE_A, a_callback, &scratch);
+
+	for (i = 0; i < 10; ++i) {
+		CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_NOERROR);
+		CHECK(resp[7] == 1);
+
+		/* one request needs more than EVLDNS_ARENA_MAX */
+		scratch = (i == 4) ? EVLDNS_ARENA_MAX * 2 : 1000;
+	}
+
+	evldns_get_port_stats(t.port, &stats);
+	CHECK(stats.pool_size == EVLDNS_POOL_DEFAULT);
+	/* every read also takes a request for the recvmsg() that fails */
+	CHECK(stats.pool_allocs == 1);
+	CHECK(stats.pool_reuses >= 9);
+	CHECK(stats.pool_in_use == 0);
+	CHECK(stats.pool_free == 1);
+
+	/* shrinking the pool frees the spare requests and their arenas */
+	CHECK(evldns_set_request_pool(t.port, 0, 0) == 0);
+	evldns_get_port_stats(t.port, &stats);
+	CHECK(stats.pool_free == 0);
+	CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_NOERROR);
+
+	test_server_free(&t);
+}
+
+static void
+test_memo(void)
+{
+	struct test_server t;
+	struct evldns_dispatch_stats stats;
+	uint8_t resp[512];
+	int calls = 0;
+
+	if (test_server_new(&t) < 0) {
+		failures++;
+		return;
+	}
+	CHECK(evldns_set_dispatch_cache(t.server, 64) == 0);
+
+	/* nothing answers, and that isn't remembered */
+	CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_REFUSED);
+	CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_REFUSED);
+	evldns_get_dispatch_stats(t.server, &stats);
+	CHECK(stats.hits == 0 && stats.misses == 2);
+
+	/* registering a callback is seen straight away */
+	evldns_add_wire_callback(t.server, "foo.example", LDNS_RR_CLASS_IN,
+		LDNS_RR_TYPE_A, late_callback, &calls);
+	CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_REFUSED);
+	CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_NOERROR);
+	CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_NOERROR);
+	evldns_get_dispatch_stats(t.server, &stats);
+	CHECK(stats.hits == 1 && stats.misses == 4);
+
+	/* and invalidates what was remembered */
+	evldns_add_wire_callback(t.server, "bar.example", LDNS_RR_CLASS_IN,
+		LDNS_RR_TYPE_A, a_callback, NULL);
+	CHECK(test_query(&t, resp, sizeof(resp)) == LDNS_RCODE_NOERROR);
+	evldns_get_dispatch_stats(t.server, &stats);
+	CHECK(stats.hits == 1 && stats.misses == 5);
+
+	test_server_free(&t);
+}
+
+static void
+test_builder(void)
+{
+	static const uint8_t rdata[200];
+	static const uint8_t bar[] = "\3bar\7example";
+	evldns_server_request req;
+	struct evldns_builder b;
+	uint8_t buf[512];
+
+	memset(&req, 0, sizeof(req));
+	req.wire_request = (uint8_t *)foo_query;
+	req.wire_reqlen = sizeof(foo_query);
+	CHECK(evldns_parse_query(foo_query, sizeof(foo_query), &req.qinfo) == 0);
+
+	/* "bar" and a pointer to "example" in the question */
+	CHECK(evldns_builder_init(&b, buf, sizeof(buf), &req, LDNS_RCODE_NOERROR) == 0);
+	CHECK(evldns_builder_rr(&b, LDNS_SECTION_ANSWER, bar, LDNS_RR_TYPE_A,
+		LDNS_RR_CLASS_IN, 60, rdata, 4) == 0);
+	CHECK(evldns_builder_finish(&b) == (int)sizeof(foo_query) + 4 + 2 + 10 + 4);
+	CHECK(ldns_read_uint16(buf + sizeof(foo_query) + 4) == (0xc000 | 16));
+
+	/* an answer that doesn't fit sets TC */
+	CHECK(evldns_builder_init(&b, buf, 120, &req, LDNS_RCODE_NOERROR) == 0);
+	CHECK(evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_TXT,
+		LDNS_RR_CLASS_IN, 60, rdata, 100) < 0);
+	CHECK(LDNS_TC_WIRE(buf));
+	CHECK(evldns_builder_finish(&b) == (int)sizeof(foo_query));
+
+	/* additional and authority records that go with an answer don't */
+	CHECK(evldns_builder_init(&b, buf, 120, &req, LDNS_RCODE_NOERROR) == 0);
+	CHECK(evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_A,
+		LDNS_RR_CLASS_IN, 60, rdata, 4) == 0);
+	CHECK(evldns_builder_rr(&b, LDNS_SECTION_AUTHORITY, NULL, LDNS_RR_TYPE_NS,
+		LDNS_RR_CLASS_IN, 60, rdata, 100) < 0);
+	CHECK(!LDNS_TC_WIRE(buf));
+	CHECK(LDNS_ANCOUNT(buf) == 1 && LDNS_NSCOUNT(buf) == 0);
+
+	CHECK(evldns_builder_init(&b, buf, 120, &req, LDNS_RCODE_NOERROR) == 0);
+	CHECK(evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_A,
+		LDNS_RR_CLASS_IN, 60, rdata, 4) == 0);
+	CHECK(evldns_builder_rr(&b, LDNS_SECTION_ADDITIONAL, bar, LDNS_RR_TYPE_A,
+		LDNS_RR_CLASS_IN, 60, rdata, 100) < 0);
+	CHECK(!LDNS_TC_WIRE(buf));
+
+	/* but the authority section of a negative response does */
+	CHECK(evldns_builder_init(&b, buf, 120, &req, LDNS_RCODE_NXDOMAIN) == 0);
+	CHECK(evldns_builder_rr(&b, LDNS_SECTION_AUTHORITY, NULL, LDNS_RR_TYPE_SOA,
+		LDNS_RR_CLASS_IN, 60, rdata, 100) < 0);
+	CHECK(LDNS_TC_WIRE(buf));
+}
+
+int main(int argc, char *argv[])
+{
+	evldns_init();
+
+	test_pool();
+	test_memo();
+	test_builder();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
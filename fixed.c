@@ -30,27 +30,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <evldns.h>
 
-/* rejects packets that arrive with OPCODE != QUERY, or QDCOUNT != 1 */
-void query_only(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass)
-{
-	ldns_pkt *req = srq->request;
-
-	if (ldns_pkt_get_opcode(req) != LDNS_PACKET_QUERY) {
-		srq->response = evldns_response(req, LDNS_RCODE_NOTIMPL);
-	}
-
-	if (ldns_pkt_qdcount(req) != 1) {
-		srq->response = evldns_response(req, LDNS_RCODE_FORMERR);
-	}
-}
-
 int main(int argc, char *argv[])
 {
 	struct event_base			*base;
 	struct evldns_server		*p;
-	evldns_callback				 arec;
+	evldns_wire_callback		 arec;
 
 	base = event_base_new();
 
@@ -65,11 +52,19 @@ int main(int argc, char *argv[])
 	evldns_load_plugin(p, ".libs/mod_arec.so");
 
 	/* get plugin defined functions */
-	arec = evldns_get_function("a");
+	arec = evldns_get_wire_function("a");
 
-	/* register a list of callbacks */
-	evldns_add_callback(p, NULL, LDNS_RR_CLASS_ANY, LDNS_RR_TYPE_ANY, query_only, NULL);
-	evldns_add_callback(p, "*", LDNS_RR_CLASS_IN, LDNS_RR_TYPE_A, arec, "192.168.1.1");
+	/*
+	 * register a list of callbacks, or with "-m" use the same list
+	 * compiled from fixed.match
+	 */
+	if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+		if (evldns_load_plugin(p, ".libs/mod_fixedmatch.so") < 0) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		evldns_add_wire_callback(p, "*", LDNS_RR_CLASS_IN, LDNS_RR_TYPE_A, arec, "192.168.1.1");
+	}
 
 	/* and set it running */
 	event_base_dispatch(base);
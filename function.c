@@ -39,6 +39,8 @@ struct fb_function {
 	TAILQ_ENTRY(fb_function)	 next;
 	const char			*name;
 	evldns_callback			 func;
+	evldns_wire_callback		 wire_func;
+	evldns_post_hook		 hook;
 };
 typedef struct fb_function fb_function;
 
@@ -60,9 +62,51 @@ evldns_callback evldns_get_function(const char *name)
 {
 	fb_function *func;
 	TAILQ_FOREACH(func, &funcs, next) {
-		if (strcmp(func->name, name) == 0) {
+		if (func->func && strcmp(func->name, name) == 0) {
 			return func->func;
 		}
 	}
 	return NULL;
 }
+
+/* wire callbacks are registered by name in the same way */
+void evldns_add_wire_function(const char *name, evldns_wire_callback func)
+{
+	fb_function *f = (fb_function *)malloc(sizeof(fb_function));
+	memset(f, 0, sizeof(fb_function));
+	f->name = strdup(name);
+	f->wire_func = func;
+	TAILQ_INSERT_TAIL(&funcs, f, next);
+}
+
+evldns_wire_callback evldns_get_wire_function(const char *name)
+{
+	fb_function *func;
+	TAILQ_FOREACH(func, &funcs, next) {
+		if (func->wire_func && strcmp(func->name, name) == 0) {
+			return func->wire_func;
+		}
+	}
+	return NULL;
+}
+
+/* and so are post hooks */
+void evldns_add_hook_function(const char *name, evldns_post_hook hook)
+{
+	fb_function *f = (fb_function *)malloc(sizeof(fb_function));
+	memset(f, 0, sizeof(fb_function));
+	f->name = strdup(name);
+	f->hook = hook;
+	TAILQ_INSERT_TAIL(&funcs, f, next);
+}
+
+evldns_post_hook evldns_get_hook_function(const char *name)
+{
+	fb_function *func;
+	TAILQ_FOREACH(func, &funcs, next) {
+		if (func->hook && strcmp(func->name, name) == 0) {
+			return func->hook;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,422 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009-2014, Nominet UK.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Nominet UK nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY Nominet UK ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Nominet UK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * matchgen - compiles a fixed table of callbacks into a C matcher
+ *
+ * usage: matchgen <file.match> > <output.c>
+ *
+ * Each line of the input is a binding, in the same order and with the
+ * same meaning as a call to evldns_add_callback():
+ *
+ *   <name> <class> <type> <function> [<data>]
+ *
+ * where <name> is a domain name, a "*.<name>" wildcard or "-" to match
+ * any name, <class> and <type> are mnemonics (or "ANY"), <function> is
+ * the name of a function registered with evldns_add_wire_function() or
+ * evldns_add_function() (in that order of preference), and the optional
+ * <data> is a word or a double-quoted string passed to it.
+ * Blank lines and those starting with '#' are ignored.
+ *
+ * The output is a plugin whose init() looks up the functions and calls
+ * evldns_set_matcher().  Its matcher switches on the length of the wire
+ * format QNAME and then compares the name bytes directly, trying the
+ * bindings that can match a name of that length in their original
+ * order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <ldns/ldns.h>
+
+#define MAX_BINDINGS	4096
+#define MAX_FUNCTIONS	256
+
+struct binding {
+	int				 line;
+	int				 kind;			/* BIND_ANY, BIND_EXACT or BIND_WILD */
+	uint8_t			 name[LDNS_MAX_DOMAINLEN + 1];	/* exact name, or wildcard parent */
+	size_t			 len;
+	ldns_rr_class	 rr_class;
+	ldns_rr_type	 rr_type;
+	int				 func;
+	char			*data;			/* NULL, or a C string literal */
+};
+
+#define BIND_ANY		0
+#define BIND_EXACT		1
+#define BIND_WILD		2
+
+static struct binding	 bindings[MAX_BINDINGS];
+static int				 nbindings;
+static char				*functions[MAX_FUNCTIONS];
+static int				 nfunctions;
+static const char		*filename;
+
+static void fail(int line, const char *msg, const char *arg)
+{
+	fprintf(stderr, "%s:%d: %s%s%s\n", filename, line, msg,
+		arg ? ": " : "", arg ? arg : "");
+	exit(EXIT_FAILURE);
+}
+
+/* returns the next whitespace separated word, or NULL */
+static char *next_word(char **p)
+{
+	char *s = *p, *start;
+
+	while (*s && isspace((unsigned char)*s)) s++;
+	if (!*s) return NULL;
+
+	start = s;
+	while (*s && !isspace((unsigned char)*s)) s++;
+	if (*s) *s++ = '\0';
+	*p = s;
+
+	return start;
+}
+
+/*
+ * turns the rest of the line into a C string literal - either a
+ * double-quoted string (with \" and \\ escapes) or a single word
+ */
+static char *parse_data(int line, char *p)
+{
+	char *out, *o;
+	int quoted;
+
+	while (*p && isspace((unsigned char)*p)) p++;
+	if (!*p) return NULL;
+
+	out = o = malloc(4 * strlen(p) + 3);
+	if (!out) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	quoted = (*p == '"');
+	if (quoted) p++;
+
+	*o++ = '"';
+	while (*p) {
+		unsigned char c = *p++;
+		if (quoted && c == '"') {
+			quoted = -1;
+			break;
+		} else if (!quoted && isspace(c)) {
+			break;
+		} else if (quoted && c == '\\' && *p) {
+			c = *p++;
+		}
+		if (c == '"' || c == '\\') {
+			o += sprintf(o, "\\%c", c);
+		} else if (isprint(c)) {
+			*o++ = c;
+		} else {
+			o += sprintf(o, "\\%03o", c);
+		}
+	}
+	*o++ = '"';
+	*o = '\0';
+
+	if (quoted > 0) fail(line, "unterminated string", NULL);
+	while (*p && isspace((unsigned char)*p)) p++;
+	if (*p) fail(line, "trailing text", p);
+
+	return out;
+}
+
+static int find_function(int line, const char *name)
+{
+	int i;
+
+	for (i = 0; i < nfunctions; ++i) {
+		if (strcmp(functions[i], name) == 0) {
+			return i;
+		}
+	}
+	if (nfunctions == MAX_FUNCTIONS) fail(line, "too many functions", NULL);
+	functions[nfunctions] = strdup(name);
+
+	return nfunctions++;
+}
+
+static void parse_line(int line, char *p)
+{
+	char *name, *cls, *type, *func;
+	struct binding *b;
+	ldns_rdf *rdf;
+
+	if (!(name = next_word(&p)) || name[0] == '#') return;
+	if (!(cls = next_word(&p)) || !(type = next_word(&p)) || !(func = next_word(&p))) {
+		fail(line, "expected <name> <class> <type> <function> [<data>]", NULL);
+	}
+	if (nbindings == MAX_BINDINGS) fail(line, "too many bindings", NULL);
+
+	b = &bindings[nbindings++];
+	b->line = line;
+
+	if (strcasecmp(cls, "ANY") == 0) {
+		b->rr_class = LDNS_RR_CLASS_ANY;
+	} else if (!(b->rr_class = ldns_get_rr_class_by_name(cls))) {
+		fail(line, "unknown class", cls);
+	}
+	if (strcasecmp(type, "ANY") == 0) {
+		b->rr_type = LDNS_RR_TYPE_ANY;
+	} else if (!(b->rr_type = ldns_get_rr_type_by_name(type))) {
+		fail(line, "unknown type", type);
+	}
+
+	if (strcmp(name, "-") == 0) {
+		b->kind = BIND_ANY;
+	} else {
+		const uint8_t *wire;
+		size_t len;
+
+		if (!(rdf = ldns_dname_new_frm_str(name))) {
+			fail(line, "bad domain name", name);
+		}
+		ldns_dname2canonical(rdf);
+
+		wire = ldns_rdf_data(rdf);
+		len = ldns_rdf_size(rdf);
+		if (len >= 2 && wire[0] == 1 && wire[1] == '*') {
+			b->kind = BIND_WILD;
+			wire += 2;
+			len -= 2;
+		} else {
+			b->kind = BIND_EXACT;
+		}
+		memcpy(b->name, wire, len);
+		b->len = len;
+		ldns_rdf_deep_free(rdf);
+	}
+
+	b->func = find_function(line, func);
+	b->data = parse_data(line, p);
+}
+
+/*-------------------------------------------------------------------*/
+
+static void print_name(const uint8_t *name, size_t len)
+{
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < len; ++i) {
+		if (isalnum(name[i]) || name[i] == '-' || name[i] == '_') {
+			putchar(name[i]);
+		} else {
+			/* octal escapes can't run into the following characters */
+			printf("\\%03o", name[i]);
+		}
+	}
+	putchar('"');
+}
+
+static void print_conditions(const struct binding *b)
+{
+	if (b->rr_class != LDNS_RR_CLASS_ANY) {
+		printf("qclass == %d && ", b->rr_class);
+	}
+	if (b->rr_type != LDNS_RR_TYPE_ANY) {
+		printf("qtype == %d && ", b->rr_type);
+	}
+}
+
+static void print_call(const struct binding *b, const char *indent)
+{
+	printf("%s\tCALL(%d, %s);\t/* line %d */\n", indent, b->func,
+		b->data ? b->data : "NULL", b->line);
+}
+
+/*
+ * prints a binding's test for a QNAME of length 'len', or of any length
+ * if 'len' is 0.  Returns 0 if it can't match names of that length.
+ */
+static int print_binding(const struct binding *b, size_t len, const char *indent)
+{
+	switch (b->kind) {
+	case BIND_EXACT:
+		if (b->len != len) return 0;
+		printf("%sif (", indent);
+		print_conditions(b);
+		printf("memcmp(q, ");
+		print_name(b->name, b->len);
+		printf(", %u) == 0) {\n", (unsigned)b->len);
+		break;
+
+	case BIND_WILD:
+		if (len && len <= b->len) return 0;
+		printf("%sif (", indent);
+		print_conditions(b);
+		if (b->len == 1) {
+			/* "*" - anything but the root */
+			printf(len ? "1" : "len > 1");
+		} else if (len) {
+			printf("memcmp(q + %u, ", (unsigned)(len - b->len));
+			print_name(b->name, b->len);
+			printf(", %u) == 0 && at_label(q, %u)", (unsigned)b->len,
+				(unsigned)(len - b->len));
+		} else {
+			printf("len > %u && memcmp(q + len - %u, ", (unsigned)b->len,
+				(unsigned)b->len);
+			print_name(b->name, b->len);
+			printf(", %u) == 0 && at_label(q, len - %u)", (unsigned)b->len,
+				(unsigned)b->len);
+		}
+		printf(") {\n");
+		break;
+
+	default:
+		printf("%sif (", indent);
+		print_conditions(b);
+		printf("1) {\n");
+		break;
+	}
+
+	print_call(b, indent);
+	printf("%s}\n", indent);
+
+	return 1;
+}
+
+static void generate(void)
+{
+	int i, j, lens[LDNS_MAX_DOMAINLEN + 1];
+
+	printf("/* generated by matchgen from %s - do not edit */\n\n", filename);
+	printf("#include <stdio.h>\n");
+	printf("#include <string.h>\n");
+	printf("#include <evldns.h>\n\n");
+
+	printf("static const char *functions[%d] = {\n", nfunctions ? nfunctions : 1);
+	for (i = 0; i < nfunctions; ++i) {
+		printf("\t\"%s\",\n", functions[i]);
+	}
+	printf("};\n");
+	printf("static evldns_callback fn[%d];\n", nfunctions ? nfunctions : 1);
+	printf("static evldns_wire_callback wfn[%d];\n\n", nfunctions ? nfunctions : 1);
+
+	printf("/* is 'off' the start of a label in the wire format name 'q'? */\n");
+	printf("static inline int at_label(const uint8_t *q, size_t off)\n");
+	printf("{\n");
+	printf("\tsize_t i = 0;\n");
+	printf("\twhile (i < off) {\n");
+	printf("\t\ti += q[i] + 1;\n");
+	printf("\t}\n");
+	printf("\treturn i == off;\n");
+	printf("}\n\n");
+
+	printf("/* calls a function, returning once something has answered or failed */\n");
+	printf("#define CALL(f, d) \\\n");
+	printf("\tif ((r = (wfn[f] ? evldns_dispatch_wire_callback(req, wfn[f], (void *)(d)) : \\\n");
+	printf("\t\tevldns_dispatch_callback(req, fn[f], (void *)(d)))) != 0) return (r < 0) ? r : 0\n\n");
+
+	printf("static int matcher(evldns_server_request *req, void *arg)\n");
+	printf("{\n");
+	printf("\tconst uint8_t *q = req->qname;\n");
+	printf("\tsize_t len = req->qinfo.qname_len;\n");
+	printf("\tint qclass = req->qinfo.qclass;\n");
+	printf("\tint qtype = req->qinfo.qtype;\n");
+	printf("\tint r;\n\n");
+	printf("\t(void)arg; (void)q; (void)qclass; (void)qtype; (void)r;\n\n");
+
+	/* one case for each length of exact name */
+	memset(lens, 0, sizeof(lens));
+	for (i = 0; i < nbindings; ++i) {
+		if (bindings[i].kind == BIND_EXACT) {
+			lens[bindings[i].len] = 1;
+		}
+	}
+
+	printf("\tswitch (len) {\n");
+	for (j = 1; j <= LDNS_MAX_DOMAINLEN; ++j) {
+		if (!lens[j]) continue;
+		printf("\tcase %d:\n", j);
+		for (i = 0; i < nbindings; ++i) {
+			print_binding(&bindings[i], j, "\t\t");
+		}
+		printf("\t\tbreak;\n");
+	}
+	printf("\tdefault:\n");
+	for (i = 0; i < nbindings; ++i) {
+		if (bindings[i].kind != BIND_EXACT) {
+			print_binding(&bindings[i], 0, "\t\t");
+		}
+	}
+	printf("\t\tbreak;\n");
+	printf("\t}\n\n");
+	printf("\treturn 0;\n");
+	printf("}\n\n");
+
+	printf("int init(struct evldns_server *p)\n");
+	printf("{\n");
+	printf("\tint i;\n\n");
+	printf("\tfor (i = 0; i < %d; ++i) {\n", nfunctions);
+	printf("\t\twfn[i] = evldns_get_wire_function(functions[i]);\n");
+	printf("\t\tif (!wfn[i] && !(fn[i] = evldns_get_function(functions[i]))) {\n");
+	printf("\t\t\tfprintf(stderr, \"%s: unknown function %%s\\n\", functions[i]);\n", filename);
+	printf("\t\t\treturn -1;\n");
+	printf("\t\t}\n");
+	printf("\t}\n");
+	printf("\tevldns_set_matcher(p, matcher, NULL);\n\n");
+	printf("\treturn 0;\n");
+	printf("}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[4096];
+	int line = 0;
+	FILE *fp;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: matchgen <file.match>\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!(fp = fopen(argv[1], "r"))) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	filename = strrchr(argv[1], '/') ? strrchr(argv[1], '/') + 1 : argv[1];
+	while (fgets(buf, sizeof(buf), fp)) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		parse_line(++line, buf);
+	}
+	fclose(fp);
+
+	generate();
+
+	return EXIT_SUCCESS;
+}
@@ -28,12 +28,17 @@
  *
  */
 
+#include <arpa/inet.h>
 #include <evldns.h>
 
 /*
  * This callback functions just returns an A record containing
  * the IP address that was passed in the 'user_data' parameter
  * (as a string) when the callback was added.
+ *
+ * It's registered both as an ordinary function and as a wire function
+ * of the same name - the wire version writes the response directly
+ * into the output buffer without building any ldns objects.
  */
 static void a_callback(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass)
 {
@@ -50,9 +55,29 @@ static void a_callback(evldns_server_request *srq, void *user_data, ldns_rdf *qn
 	srq->response = resp;
 }
 
+/* the same, as a wire callback */
+static int a_wire_callback(evldns_server_request *srq, void *user_data, const struct evldns_query_info *qinfo, uint8_t *out, size_t outlen)
+{
+	struct evldns_builder b;
+	struct in_addr addr;
+
+	if (qinfo->qdcount != 1 || inet_pton(AF_INET, user_data, &addr) != 1) {
+		return 0;
+	}
+
+	if (evldns_builder_init(&b, out, outlen, srq, LDNS_RCODE_NOERROR) < 0) {
+		return 0;
+	}
+	evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_A,
+		qinfo->qclass, 3600L, (uint8_t *)&addr, sizeof(addr));
+
+	return evldns_builder_finish(&b);
+}
+
 int init(struct evldns_server *p)
 {
 	evldns_add_function("a", a_callback);
+	evldns_add_wire_function("a", a_wire_callback);
 
 	return 0;
 }
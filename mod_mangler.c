@@ -32,33 +32,25 @@
 #include <evldns.h>
 
 /*
- * This function is not actually a callback, although it has
- * the same parameter signature as a callback
- *
- * Given an 'evldns_server_request' that has _already_ been
- * populated, it randomly flips bits in the output buffer
- * based on the value supplied in 'user_data'
+ * This is a post hook, called with each 'evldns_server_request'
+ * once its wire format response is ready to be sent.  It
+ * randomly flips bits in the output buffer based on the value
+ * supplied in 'user_data'
  *
  * NB: user_data should be passed directly as an integer,
- * not as a pointer to an integer
+ * not as a pointer to an integer, e.g.
+ *
+ *   evldns_add_post_hook(server, evldns_get_hook_function("bitflip"),
+ *       (void *)4L);
  */
-static void bitflip(evldns_server_request *srq, void *user_data, ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass)
+static int bitflip(evldns_server_request *srq, void *user_data)
 {
 	int		n_bits = (int)(long)user_data;
 	int		i;
 
 	/* can't mangle an empty packet */
-	if (!srq->response && !srq->wire_response) {
-		return;
-	}
-
-	/* convert LDNS packet to wire format if necessary */
-	if (!srq->wire_response) {
-		ldns_status status = ldns_pkt2wire(&srq->wire_response,
-			srq->response, &srq->wire_resplen);
-		if (status != LDNS_STATUS_OK) {
-			return;
-		}
+	if (!srq->wire_resplen) {
+		return 0;
 	}
 
 	if (n_bits < 1) {
@@ -71,11 +63,13 @@ static void bitflip(evldns_server_request *srq, void *user_data, ldns_rdf *qname
 		int bit = random() % 8;
 		srq->wire_response[offset] ^= (1 << bit);
 	}
+
+	return 0;
 }
 
 int init(struct evldns_server *p)
 {
-	evldns_add_function("bitflip", bitflip);
+	evldns_add_hook_function("bitflip", bitflip);
 
 	return 0;
 }
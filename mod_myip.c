@@ -28,6 +28,7 @@
  *
  */
 
+#include <string.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -54,6 +55,9 @@ static void myip_callback(evldns_server_request *srq, void *user_data, ldns_rdf
 	ldns_rr *question = ldns_rr_list_rr(ldns_pkt_question(req), 0);
 	ldns_rr_list *answer = ldns_pkt_answer(resp);
 
+	/* the answer depends on who's asking */
+	evldns_set_cache_ttl(srq, 0);
+
 	/* generate TXT records for client address */
 	if ((qclass == LDNS_RR_CLASS_IN || qclass == LDNS_RR_CLASS_CH) &&
 	     (qtype == LDNS_RR_TYPE_TXT ||  qtype == LDNS_RR_TYPE_ANY))
@@ -103,9 +107,64 @@ static void myip_callback(evldns_server_request *srq, void *user_data, ldns_rdf
 	srq->response = resp;
 }
 
+/* the same, as a wire callback */
+static int myip_wire_callback(evldns_server_request *srq, void *user_data, const struct evldns_query_info *qinfo, uint8_t *out, size_t outlen)
+{
+	ldns_rr_type qtype = qinfo->qtype;
+	ldns_rr_class qclass = qinfo->qclass;
+	struct evldns_builder b;
+
+	if (qinfo->qdcount != 1) {
+		return 0;
+	}
+
+	/* the answer depends on who's asking */
+	evldns_set_cache_ttl(srq, 0);
+
+	if (evldns_builder_init(&b, out, outlen, srq, LDNS_RCODE_NOERROR) < 0) {
+		return 0;
+	}
+
+	/* generate TXT records for client address */
+	if ((qclass == LDNS_RR_CLASS_IN || qclass == LDNS_RR_CLASS_CH) &&
+	     (qtype == LDNS_RR_TYPE_TXT ||  qtype == LDNS_RR_TYPE_ANY))
+	{
+		char nbuf[NI_MAXHOST];
+
+		if (getnameinfo((struct sockaddr *)&srq->addr, srq->addrlen,
+				nbuf + 1, sizeof(nbuf) - 1, NULL, 0,
+				NI_NUMERICHOST) == 0)
+		{
+			size_t len = strlen(nbuf + 1);
+			nbuf[0] = (char)len;
+			evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_TXT,
+				qclass, 0L, (uint8_t *)nbuf, len + 1);
+		}
+	}
+
+	/* generate A records for client address, if the query arrived on IPv4 */
+	if (qclass == LDNS_RR_CLASS_IN && srq->addr.ss_family == AF_INET &&
+	    (qtype == LDNS_RR_TYPE_A || qtype == LDNS_RR_TYPE_ANY)) {
+		struct sockaddr_in *p = (struct sockaddr_in *)&srq->addr;
+		evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_A,
+			qclass, 0L, (uint8_t *)&p->sin_addr.s_addr, 4);
+	}
+
+	/* generate AAAA records for client address, if the query arrived on IPv6 */
+	if (qclass == LDNS_RR_CLASS_IN && srq->addr.ss_family == AF_INET6 &&
+	    (qtype == LDNS_RR_TYPE_AAAA || qtype == LDNS_RR_TYPE_ANY)) {
+		struct sockaddr_in6 *p = (struct sockaddr_in6 *)&srq->addr;
+		evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_AAAA,
+			qclass, 0L, p->sin6_addr.s6_addr, 16);
+	}
+
+	return evldns_builder_finish(&b);
+}
+
 int init(struct evldns_server *p)
 {
 	evldns_add_function("myip", myip_callback);
+	evldns_add_wire_function("myip", myip_wire_callback);
 
 	return 0;
 }
@@ -28,6 +28,7 @@
  *
  */
 
+#include <ctype.h>
 #include <evldns.h>
 
 /*
@@ -50,9 +51,64 @@ static void txt_callback(evldns_server_request *srq, void *user_data, ldns_rdf *
 	srq->response = resp;
 }
 
+/*
+ * turns 'str' into a TXT character-string as ldns_rdf_new_frm_str()
+ * would, with \DDD giving a byte in decimal and \X giving X itself.
+ * Returns the length, including the length byte, or 0 if it's too long.
+ */
+static size_t txt_string(const char *str, uint8_t *rdata)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	size_t len = 0;
+
+	while (*s) {
+		unsigned int c = *s++;
+
+		if (c == '\\' && *s) {
+			if (isdigit(s[0]) && isdigit(s[1]) && isdigit(s[2])) {
+				c = (s[0] - '0') * 100 + (s[1] - '0') * 10 + (s[2] - '0');
+				s += 3;
+				if (c > 255) {
+					return 0;
+				}
+			} else {
+				c = *s++;
+			}
+		}
+		if (len == 255) {
+			return 0;
+		}
+		rdata[++len] = (uint8_t)c;
+	}
+	rdata[0] = (uint8_t)len;
+
+	return len + 1;
+}
+
+/* the same, as a wire callback */
+static int txt_wire_callback(evldns_server_request *srq, void *user_data, const struct evldns_query_info *qinfo, uint8_t *out, size_t outlen)
+{
+	struct evldns_builder b;
+	uint8_t rdata[256];
+	size_t len;
+
+	if (qinfo->qdcount != 1 || !(len = txt_string(user_data, rdata))) {
+		return 0;
+	}
+
+	if (evldns_builder_init(&b, out, outlen, srq, LDNS_RCODE_NOERROR) < 0) {
+		return 0;
+	}
+	evldns_builder_rr(&b, LDNS_SECTION_ANSWER, NULL, LDNS_RR_TYPE_TXT,
+		qinfo->qclass, 0L, rdata, len);
+
+	return evldns_builder_finish(&b);
+}
+
 int init(struct evldns_server *p)
 {
 	evldns_add_function("txt", txt_callback);
+	evldns_add_wire_function("txt", txt_wire_callback);
 
 	return 0;
 }
@@ -28,6 +28,10 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -38,11 +42,22 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <syslog.h>
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+#ifdef HAVE_LINUX_SOCK_DIAG_H
+#include <linux/sock_diag.h>
+#endif
 #include <evldns.h>
 
 /*--------------------------------------------------------------------*/
 
 int bind_to_sockaddr(struct sockaddr* addr, socklen_t addrlen, int type, int backlog)
+{
+	return bind_to_sockaddr_opts(addr, addrlen, type, backlog, NULL);
+}
+
+int bind_to_sockaddr_opts(struct sockaddr* addr, socklen_t addrlen, int type, int backlog, const struct evldns_sockopts *opts)
 {
 	int					 r, s;
 	int					 reuse = 1;
@@ -70,6 +85,114 @@ int bind_to_sockaddr(struct sockaddr* addr, socklen_t addrlen, int type, int bac
 		perror("setsockopt(SO_REUSEADDR)");
 	}
 
+	/* allow several sockets to share the address, e.g. one per thread */
+	if (opts && (opts->flags & EVLDNS_SOCK_REUSEPORT)) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))) {
+			perror("setsockopt(SO_REUSEPORT)");
+			close(s);
+			return -1;
+		}
+#else
+		fprintf(stderr, "SO_REUSEPORT not supported\n");
+		close(s);
+		return -1;
+#endif
+	}
+
+	/* have the kernel spin on the device queue when reads would block */
+	if (opts && (opts->flags & EVLDNS_SOCK_BUSY_POLL)) {
+#ifdef SO_BUSY_POLL
+		int usec = opts->busy_poll_usec ? opts->busy_poll_usec : EVLDNS_BUSY_POLL_USEC;
+		if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec))) {
+			perror("setsockopt(SO_BUSY_POLL)");
+		}
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+		if (setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, &reuse, sizeof(reuse))) {
+			perror("setsockopt(SO_PREFER_BUSY_POLL)");
+		}
+#endif
+	}
+
+	/* socket buffer sizes, bypassing the sysctl limits if permitted */
+	if (opts && opts->rcvbuf > 0) {
+		r = -1;
+#ifdef SO_RCVBUFFORCE
+		r = setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &opts->rcvbuf, sizeof(opts->rcvbuf));
+#endif
+		if (r < 0 && setsockopt(s, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, sizeof(opts->rcvbuf))) {
+			perror("setsockopt(SO_RCVBUF)");
+		}
+	}
+	if (opts && opts->sndbuf > 0) {
+		r = -1;
+#ifdef SO_SNDBUFFORCE
+		r = setsockopt(s, SOL_SOCKET, SO_SNDBUFFORCE, &opts->sndbuf, sizeof(opts->sndbuf));
+#endif
+		if (r < 0 && setsockopt(s, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, sizeof(opts->sndbuf))) {
+			perror("setsockopt(SO_SNDBUF)");
+		}
+	}
+
+	/*
+	 * never fragment based on (possibly spoofed) ICMP "too big"
+	 * messages, and don't set DF - for UDP only
+	 */
+	if (opts && (opts->flags & EVLDNS_SOCK_PMTUDISC_OMIT) && type == SOCK_DGRAM) {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_OMIT)
+		if (addr->sa_family == AF_INET) {
+			int omit = IP_PMTUDISC_OMIT;
+			if (setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &omit, sizeof(omit))) {
+				perror("setsockopt(IP_MTU_DISCOVER)");
+			}
+		}
+#endif
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_OMIT)
+		if (addr->sa_family == AF_INET6) {
+			int omit = IPV6_PMTUDISC_OMIT;
+			if (setsockopt(s, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &omit, sizeof(omit))) {
+				perror("setsockopt(IPV6_MTU_DISCOVER)");
+			}
+		}
+#endif
+	}
+
+	/*
+	 * report each datagram's destination address, so that a socket
+	 * bound to a wildcard address can reply from the right address
+	 */
+	if (opts && (opts->flags & EVLDNS_SOCK_PKTINFO) && type == SOCK_DGRAM) {
+#ifdef IP_PKTINFO
+		if (addr->sa_family == AF_INET &&
+			setsockopt(s, IPPROTO_IP, IP_PKTINFO, &reuse, sizeof(reuse)))
+		{
+			perror("setsockopt(IP_PKTINFO)");
+		}
+#endif
+#ifdef IPV6_RECVPKTINFO
+		if (addr->sa_family == AF_INET6 &&
+			setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &reuse, sizeof(reuse)))
+		{
+			perror("setsockopt(IPV6_RECVPKTINFO)");
+		}
+#endif
+	}
+
+	/* report the socket's drop counter with each datagram received */
+	if (opts && (opts->flags & EVLDNS_SOCK_RXQ_OVFL) && type == SOCK_DGRAM) {
+#ifdef SO_RXQ_OVFL
+		if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &reuse, sizeof(reuse))) {
+			perror("setsockopt(SO_RXQ_OVFL)");
+		}
+#endif
+	}
+
+	/* drop junk in the kernel */
+	if (opts && opts->filter && type == SOCK_DGRAM) {
+		(void)socket_attach_filter(s, opts->filter);
+	}
+
 	/* bind to that local address */
 	if ((r = bind(s, addr, addrlen)) < 0) {
 		perror("bind");
@@ -102,6 +225,11 @@ int bind_to_sockaddr(struct sockaddr* addr, socklen_t addrlen, int type, int bac
 }
 
 int bind_to_port(int port, int family, int type, int backlog)
+{
+	return bind_to_port_opts(port, family, type, backlog, NULL);
+}
+
+int bind_to_port_opts(int port, int family, int type, int backlog, const struct evldns_sockopts *opts)
 {
 	/* set up the local address (protocol specific) */
 	if (family == AF_INET) {
@@ -111,7 +239,7 @@ int bind_to_port(int port, int family, int type, int backlog)
 		addr.sin_family = family;
 		addr.sin_addr.s_addr = INADDR_ANY;
 		addr.sin_port = htons(port);
-		return bind_to_sockaddr((struct sockaddr *)&addr, sizeof(addr), type, backlog);
+		return bind_to_sockaddr_opts((struct sockaddr *)&addr, sizeof(addr), type, backlog, opts);
 	} else if (family == AF_INET6) {
 		struct sockaddr_in6		addr;
 		memset(&addr, 0, sizeof(addr));
@@ -119,7 +247,7 @@ int bind_to_port(int port, int family, int type, int backlog)
 		addr.sin6_family = AF_INET6;
 		addr.sin6_addr = in6addr_any;
 		addr.sin6_port = htons(port);
-		return bind_to_sockaddr((struct sockaddr *)&addr, sizeof(addr), type, backlog);
+		return bind_to_sockaddr_opts((struct sockaddr *)&addr, sizeof(addr), type, backlog, opts);
 	} else {
 		fprintf(stderr, "address family %d not recognized\n", family);
 		return -1;
@@ -127,6 +255,11 @@ int bind_to_port(int port, int family, int type, int backlog)
 }
 
 int bind_to_address(const char *ipaddr, const char *port, int type, int backlog)
+{
+	return bind_to_address_opts(ipaddr, port, type, backlog, NULL);
+}
+
+int bind_to_address_opts(const char *ipaddr, const char *port, int type, int backlog, const struct evldns_sockopts *opts)
 {
 	struct sockaddr_storage	addr;
 	int						addrlen;
@@ -147,7 +280,7 @@ int bind_to_address(const char *ipaddr, const char *port, int type, int backlog)
 	memcpy(&addr, ai->ai_addr, addrlen);
 	freeaddrinfo(ai);
 
-	return bind_to_sockaddr((struct sockaddr  *)&addr, addrlen, type, backlog);
+	return bind_to_sockaddr_opts((struct sockaddr  *)&addr, addrlen, type, backlog, opts);
 }
 
 /*--------------------------------------------------------------------*/
@@ -189,6 +322,11 @@ int bind_to_tcp6_port(int port, int backlog)
 /*--------------------------------------------------------------------*/
 
 int *bind_to_all(const char *ipaddr, const char *port, int backlog)
+{
+	return bind_to_all_opts(ipaddr, port, backlog, NULL);
+}
+
+int *bind_to_all_opts(const char *ipaddr, const char *port, int backlog, const struct evldns_sockopts *opts)
 {
 	struct sockaddr_storage	addr;
 	struct addrinfo			hints, *ai, *ai0;
@@ -223,7 +361,7 @@ int *bind_to_all(const char *ipaddr, const char *port, int backlog)
 		memset(&addr, 0, sizeof(addr));
 		memcpy(&addr, ai->ai_addr, addrlen);
 
-		int fd = bind_to_sockaddr((struct sockaddr *)&addr, addrlen, ai->ai_socktype, backlog);
+		int fd = bind_to_sockaddr_opts((struct sockaddr *)&addr, addrlen, ai->ai_socktype, backlog, opts);
 		if (fd >= 0) {
 			result[current++] = fd;
 		}
@@ -236,6 +374,26 @@ int *bind_to_all(const char *ipaddr, const char *port, int backlog)
 	return result;
 }
 
+/*
+ * binds one UDP and one TCP socket to the wildcard address of each
+ * address family instead of one per local address.  The UDP sockets
+ * are given EVLDNS_SOCK_PKTINFO so that responses are still sent from
+ * the address each query was sent to.
+ */
+int *bind_to_wildcard(const char *port, int backlog, const struct evldns_sockopts *opts)
+{
+	struct evldns_sockopts wopts;
+
+	if (opts) {
+		wopts = *opts;
+	} else {
+		memset(&wopts, 0, sizeof(wopts));
+	}
+	wopts.flags |= EVLDNS_SOCK_PKTINFO;
+
+	return bind_to_all_opts(NULL, port, backlog, &wopts);
+}
+
 /*--------------------------------------------------------------------*/
 
 int socket_is_tcp(int fd)
@@ -247,3 +405,161 @@ int socket_is_tcp(int fd)
 
 	return (type == SOCK_STREAM);
 }
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * attaches a classic BPF program to a socket's SO_REUSEPORT group that
+ * hands each packet to the socket of the worker running on the CPU that
+ * received it.  Socket 'n' in the group (i.e. the n'th one bound) is
+ * assumed to belong to the worker on cpus[n], and packets arriving on
+ * any other CPU are spread by CPU number modulo 'count'.
+ */
+int socket_steer_by_cpu(int fd, const int *cpus, int count)
+{
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_filter	*code;
+	struct sock_fprog	 prog;
+	int					 i, n = 0, r;
+
+	if (count < 1 || count > (BPF_MAXINSNS - 4) / 2) {
+		fprintf(stderr, "socket_steer_by_cpu: bad worker count %d\n", count);
+		return -1;
+	}
+
+	if (!(code = calloc(2 * count + 4, sizeof(*code)))) {
+		perror("calloc");
+		return -1;
+	}
+
+	/* A = the receiving CPU */
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+	/* if A == cpus[i] return i */
+	for (i = 0; cpus && i < count; ++i) {
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+
+	/* otherwise return A % count */
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	prog.len = n;
+	prog.filter = code;
+
+	r = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+	if (r < 0) {
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+	}
+	free(code);
+
+	return r;
+#else
+	fprintf(stderr, "SO_ATTACH_REUSEPORT_CBPF not supported\n");
+	return -1;
+#endif
+}
+
+/*
+ * attaches a classic BPF program to a UDP socket that drops, in the
+ * kernel, the kinds of packet selected by the EVLDNS_FILTER_* 'rules'.
+ * Dropped packets count towards the socket's drop counter - see
+ * socket_drop_count().
+ */
+int socket_attach_filter(int fd, unsigned int rules)
+{
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+	struct sock_filter	 code[16];
+	struct sock_fprog	 prog;
+	int					 drops[4];
+	int					 i, n = 0, ndrops = 0, r;
+
+	/* the filter sees the UDP header, so the DNS header starts at 8 */
+#define DNS_OFF		8
+#define ACCEPT		((unsigned int)-1)
+
+	/* packets too short for a DNS header can't be inspected further */
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, DNS_OFF + 12, 1, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+		(rules & EVLDNS_FILTER_SHORT) ? 0 : ACCEPT);
+
+	/* QR and OPCODE are in the first flags byte */
+	if (rules & (EVLDNS_FILTER_QR | EVLDNS_FILTER_OPCODE)) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, DNS_OFF + 2);
+	}
+	if (rules & EVLDNS_FILTER_QR) {
+		drops[ndrops++] = n;
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 0, 0);
+	}
+	if (rules & EVLDNS_FILTER_OPCODE) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x78);
+		drops[ndrops++] = n;
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0);
+	}
+	if (rules & EVLDNS_FILTER_QDCOUNT) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, DNS_OFF + 4);
+		drops[ndrops++] = n;
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 0);
+	}
+
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ACCEPT);
+	code[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	/*
+	 * point the tests at the final drop instruction - JSET drops when
+	 * the bit is set, the JEQs when the value doesn't match
+	 */
+	for (i = 0; i < ndrops; ++i) {
+		uint8_t off = n - drops[i] - 1;
+		if (BPF_OP(code[drops[i]].code) == BPF_JSET) {
+			code[drops[i]].jt = off;
+		} else {
+			code[drops[i]].jf = off;
+		}
+	}
+	n++;
+
+#undef DNS_OFF
+#undef ACCEPT
+
+	prog.len = n;
+	prog.filter = code;
+
+	r = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+	if (r < 0) {
+		perror("setsockopt(SO_ATTACH_FILTER)");
+	}
+
+	return r;
+#else
+	fprintf(stderr, "SO_ATTACH_FILTER not supported\n");
+	return -1;
+#endif
+}
+
+/*
+ * reads a socket's drop counter, which counts packets dropped by an
+ * attached filter as well as those dropped because the receive buffer
+ * was full
+ */
+int socket_drop_count(int fd, uint32_t *drops)
+{
+#if defined(HAVE_LINUX_SOCK_DIAG_H) && defined(SO_MEMINFO)
+	uint32_t	meminfo[SK_MEMINFO_VARS];
+	socklen_t	len = sizeof(meminfo);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0) {
+		return -1;
+	}
+	if (len <= SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+		return -1;
+	}
+	*drops = meminfo[SK_MEMINFO_DROPS];
+
+	return 0;
+#else
+	return -1;
+#endif
+}
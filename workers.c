@@ -0,0 +1,394 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009-2014, Nominet UK.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Nominet UK nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY Nominet UK ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Nominet UK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+#if defined(HAVE_NUMA_H) && defined(HAVE_LIBNUMA)
+#include <numa.h>
+#endif
+#include <evldns.h>
+
+/*
+ * Each worker thread runs its own event_base with its own set of
+ * SO_REUSEPORT sockets, so the kernel spreads incoming queries and
+ * connections across the workers.  All of the workers' servers share
+ * the callback table of the server passed to evldns_workers_start().
+ *
+ * Optionally each worker can be pinned to a CPU, with its memory on
+ * that CPU's NUMA node, and each packet steered to the worker running
+ * on the CPU that received it so that it never crosses cores.
+ */
+
+struct evldns_worker {
+	struct evldns_workers		*workers;
+	int							 index;
+	int							 cpu;
+	pthread_t					 thread;
+	unsigned int				 started:1;
+	int							 status;	/* 0 starting, 1 running, -1 failed */
+	int							*sockets;
+	int							 wakeup[2];
+	struct event_base			*base;
+	struct evldns_server		*server;
+};
+typedef struct evldns_worker evldns_worker;
+
+struct evldns_workers {
+	struct evldns_server		*parent;
+	struct evldns_worker_config	 config;
+	unsigned int				 nworkers;
+	evldns_worker				*worker;
+
+	/* each worker reports whether it set itself up */
+	pthread_mutex_t				 lock;
+	pthread_cond_t				 ready;
+};
+typedef struct evldns_workers evldns_workers;
+
+/*--------------------------------------------------------------------*/
+
+static void
+worker_wakeup_callback(int fd, short events, void *arg)
+{
+	evldns_worker *worker = (evldns_worker *)arg;
+	char buf[16];
+
+	(void)read(fd, buf, sizeof(buf));
+	evldns_server_poll_break(worker->server);
+}
+
+static void
+worker_report(evldns_worker *worker, int status)
+{
+	evldns_workers *workers = worker->workers;
+
+	pthread_mutex_lock(&workers->lock);
+	worker->status = status;
+	pthread_cond_broadcast(&workers->ready);
+	pthread_mutex_unlock(&workers->lock);
+}
+
+static void *
+worker_main(void *arg)
+{
+	evldns_worker *worker = (evldns_worker *)arg;
+	const struct evldns_worker_config *config = &worker->workers->config;
+	struct event *wakeup;
+	int *fd;
+
+	/*
+	 * pin the thread first so that everything it allocates from
+	 * here on is first touched on (and so placed on) its own node
+	 */
+	if (config->flags & EVLDNS_WORKER_PIN_CPU) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+		cpu_set_t cpuset;
+		int r;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(worker->cpu, &cpuset);
+		r = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+		if (r != 0) {
+			fprintf(stderr, "worker %d: pthread_setaffinity_np: %s\n",
+				worker->index, strerror(r));
+		}
+#else
+		fprintf(stderr, "worker %d: CPU pinning not supported\n", worker->index);
+#endif
+	}
+
+	/* override any inherited (e.g. interleaved) memory policy */
+	if (config->flags & EVLDNS_WORKER_NUMA_LOCAL) {
+#if defined(HAVE_NUMA_H) && defined(HAVE_LIBNUMA)
+		if (numa_available() >= 0) {
+			numa_set_localalloc();
+		}
+#endif
+	}
+
+	/* failures are reported to evldns_workers_start(), which cleans up */
+	worker->base = event_base_new();
+	if (!worker->base) {
+		fprintf(stderr, "worker %d: event_base_new failed\n", worker->index);
+		worker_report(worker, -1);
+		return NULL;
+	}
+
+	worker->server = evldns_add_server_shared(worker->base, worker->workers->parent);
+	if (!worker->server) {
+		fprintf(stderr, "worker %d: evldns_add_server_shared failed\n", worker->index);
+		worker_report(worker, -1);
+		return NULL;
+	}
+
+	/* ports are created here so that their memory belongs to this thread */
+	for (fd = worker->sockets; *fd >= 0; ++fd) {
+		struct evldns_server_port *port = evldns_add_server_port(worker->server, *fd);
+		if (!port) {
+			fprintf(stderr, "worker %d: evldns_add_server_port failed\n", worker->index);
+			worker_report(worker, -1);
+			return NULL;
+		}
+		if (config->port_init) {
+			config->port_init(port, worker->index, config->arg);
+		}
+	}
+
+	wakeup = event_new(worker->base, worker->wakeup[0], EV_READ | EV_PERSIST,
+		worker_wakeup_callback, worker);
+	if (!wakeup || event_add(wakeup, NULL) < 0) {
+		fprintf(stderr, "worker %d: can't watch the wakeup pipe\n", worker->index);
+		if (wakeup) event_free(wakeup);
+		worker_report(worker, -1);
+		return NULL;
+	}
+
+	worker_report(worker, 1);
+
+	if (config->flags & EVLDNS_WORKER_BUSY_POLL) {
+		evldns_server_poll(worker->server, config->poll_idle_usec);
+	} else {
+		event_base_dispatch(worker->base);
+	}
+
+	event_free(wakeup);
+
+	return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+workers_free(evldns_workers *workers)
+{
+	unsigned int i;
+	int *fd;
+
+	for (i = 0; i < workers->nworkers; ++i) {
+		evldns_worker *worker = &workers->worker[i];
+
+		/* the server's events must go before the base does */
+		if (worker->server) {
+			evldns_free_server(worker->server);
+		}
+		if (worker->base) {
+			event_base_free(worker->base);
+		}
+		if (worker->sockets) {
+			for (fd = worker->sockets; *fd >= 0; ++fd) {
+				close(*fd);
+			}
+			free(worker->sockets);
+		}
+		if (worker->wakeup[0] >= 0) close(worker->wakeup[0]);
+		if (worker->wakeup[1] >= 0) close(worker->wakeup[1]);
+	}
+
+	pthread_cond_destroy(&workers->ready);
+	pthread_mutex_destroy(&workers->lock);
+	free(workers->worker);
+	free(workers);
+}
+
+/*
+ * attaches a CPU steering program to each of the SO_REUSEPORT groups -
+ * the n'th socket in each group is the n'th worker's, since they were
+ * bound in worker order
+ */
+static int
+workers_steer(evldns_workers *workers)
+{
+	unsigned int i;
+	int n, count = -1, *cpus, r = 0;
+
+	for (i = 0; i < workers->nworkers; ++i) {
+		for (n = 0; workers->worker[i].sockets[n] >= 0; ++n)
+			;
+		if (count >= 0 && n != count) {
+			fprintf(stderr, "worker %u: socket count mismatch, can't steer\n", i);
+			return -1;
+		}
+		count = n;
+	}
+
+	if (!(cpus = calloc(workers->nworkers, sizeof(int)))) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < workers->nworkers; ++i) {
+		cpus[i] = workers->worker[i].cpu;
+	}
+
+	for (n = 0; n < count && r == 0; ++n) {
+		r = socket_steer_by_cpu(workers->worker[0].sockets[n], cpus, (int)workers->nworkers);
+	}
+	free(cpus);
+
+	return r;
+}
+
+struct evldns_workers *
+evldns_workers_start(struct evldns_server *server, const struct evldns_worker_config *config)
+{
+	struct evldns_sockopts	 opts;
+	evldns_workers			*workers;
+	unsigned int			 i;
+	int						 failed = 0;
+
+	if (config->nworkers < 1) {
+		fprintf(stderr, "evldns_workers_start: no workers requested\n");
+		return NULL;
+	}
+
+	if (!(workers = calloc(1, sizeof(*workers)))) {
+		perror("calloc");
+		return NULL;
+	}
+	workers->parent = server;
+	workers->config = *config;
+	pthread_mutex_init(&workers->lock, NULL);
+	pthread_cond_init(&workers->ready, NULL);
+
+	if (!(workers->worker = calloc((size_t)config->nworkers, sizeof(evldns_worker)))) {
+		perror("calloc");
+		workers_free(workers);
+		return NULL;
+	}
+
+	/*
+	 * bind every worker's sockets up front, in worker order, so that
+	 * failures are reported to the caller rather than in a thread
+	 */
+	if (config->sockopts) {
+		opts = *config->sockopts;
+	} else {
+		memset(&opts, 0, sizeof(opts));
+	}
+	opts.flags |= EVLDNS_SOCK_REUSEPORT;
+	if (!config->addr) {
+		opts.flags |= EVLDNS_SOCK_PKTINFO;	/* wildcard sockets */
+	}
+	if (config->flags & EVLDNS_WORKER_BUSY_POLL) {
+		opts.flags |= EVLDNS_SOCK_BUSY_POLL;
+	}
+
+	for (i = 0; i < (unsigned int)config->nworkers; ++i) {
+		evldns_worker *worker = &workers->worker[i];
+
+		worker->workers = workers;
+		worker->index = (int)i;
+		worker->cpu = config->cpus ? config->cpus[i] : (int)i;
+		worker->wakeup[0] = worker->wakeup[1] = -1;
+		workers->nworkers++;
+
+		worker->sockets = bind_to_all_opts(config->addr, config->port,
+			config->backlog, &opts);
+		if (!worker->sockets || worker->sockets[0] < 0) {
+			fprintf(stderr, "worker %u: no sockets bound\n", i);
+			workers_free(workers);
+			return NULL;
+		}
+
+		if (pipe(worker->wakeup) < 0) {
+			perror("pipe");
+			workers_free(workers);
+			return NULL;
+		}
+		(void)fcntl(worker->wakeup[0], F_SETFL, O_NONBLOCK);
+	}
+
+	if ((config->flags & EVLDNS_WORKER_CPU_STEER) && workers_steer(workers) < 0) {
+		workers_free(workers);
+		return NULL;
+	}
+
+	for (i = 0; i < workers->nworkers; ++i) {
+		evldns_worker *worker = &workers->worker[i];
+		int r = pthread_create(&worker->thread, NULL, worker_main, worker);
+		if (r != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			evldns_workers_stop(workers);
+			return NULL;
+		}
+		worker->started = 1;
+	}
+
+	/* wait for every worker to report in before declaring success */
+	pthread_mutex_lock(&workers->lock);
+	for (i = 0; i < workers->nworkers; ++i) {
+		while (workers->worker[i].status == 0) {
+			pthread_cond_wait(&workers->ready, &workers->lock);
+		}
+		if (workers->worker[i].status < 0) {
+			failed = 1;
+		}
+	}
+	pthread_mutex_unlock(&workers->lock);
+
+	if (failed) {
+		evldns_workers_stop(workers);
+		return NULL;
+	}
+
+	return workers;
+}
+
+void
+evldns_workers_stop(struct evldns_workers *workers)
+{
+	unsigned int i;
+
+	for (i = 0; i < workers->nworkers; ++i) {
+		evldns_worker *worker = &workers->worker[i];
+		if (worker->started) {
+			(void)write(worker->wakeup[1], "x", 1);
+		}
+	}
+
+	for (i = 0; i < workers->nworkers; ++i) {
+		evldns_worker *worker = &workers->worker[i];
+		if (worker->started) {
+			pthread_join(worker->thread, NULL);
+		}
+	}
+
+	workers_free(workers);
+}